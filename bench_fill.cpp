@@ -0,0 +1,141 @@
+// bench_fill.cpp
+// Micro-benchmark of the row kernels used by DrawBlock, DrawBlockBlend and DrawGradient, in pixels per second.
+// Each kernel is checked against the scalar one first.
+// Build (Linux): g++ -O2 -pthread -DOS_HEADLESS=1 bench_fill.cpp -o bench_fill
+#define BUILD_EXAMPLE 0
+#include "main.cpp"
+
+#include <chrono>
+
+const char *kernelNames[FILL_KERNEL_COUNT] = { "scalar", "sse2", "avx2", "avx512" };
+
+double SecondsNow()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+enum Operation
+{
+	OPERATION_FILL,			// DrawBlock
+	OPERATION_BLEND,		// DrawBlockBlend with a translucent colour
+	OPERATION_GRADIENT,		// DrawGradient, horizontal, between translucent colours
+	OPERATION_COUNT,
+};
+
+const char *operationNames[OPERATION_COUNT] = { "fill", "blend", "gradient" };
+
+void Draw(Operation operation, Painter *painter, Rectangle rectangle, uint32_t seed)
+{
+	if (operation == OPERATION_FILL) DrawBlock(painter, rectangle, seed);
+	if (operation == OPERATION_BLEND) DrawBlockBlend(painter, rectangle, 0x80402010 + (seed & 0x0F));
+	if (operation == OPERATION_GRADIENT) DrawGradient(painter, rectangle, 0xC0604020, 0x40102030 + (seed & 0x0F), false);
+}
+
+// Draw awkwardly aligned rectangles with the kernel and compare against the scalar kernel,
+// including the pixels just outside the rectangle, which must not be touched.
+bool Verify(FillKernel kernel, Operation operation)
+{
+	int width = 67, height = 5;
+	uint32_t *expected = (uint32_t *) malloc(width * height * 4);
+	uint32_t *actual = (uint32_t *) malloc(width * height * 4);
+	bool ok = true;
+
+	for (int l = 0; l < 20 && ok; l++)
+	{
+		for (int r = l; r <= width && ok; r++)
+		{
+			for (int pass = 0; pass < 2; pass++)
+			{
+				uint32_t *bits = pass ? actual : expected;
+				for (int i = 0; i < width * height; i++) bits[i] = (uint32_t) i * 2654435761u;
+				DrawSetFillKernel(pass ? kernel : FILL_KERNEL_SCALAR);
+				Painter painter = {};
+				painter.clip = RectangleMake(0, width, 0, height);
+				painter.bits = bits;
+				painter.width = painter.stride = width;
+				painter.height = height;
+				Draw(operation, &painter, RectangleMake(l, r, 1, 4), 0x123456);
+			}
+
+			ok = 0 == memcmp(expected, actual, width * height * 4);
+		}
+	}
+
+	free(expected);
+	free(actual);
+	return ok;
+}
+
+int main()
+{
+	Initialise();
+	FillKernel selected = global.fillKernel;
+	printf("kernel selected at startup: %s\n\n", kernelNames[selected]);
+
+	struct { int width, height; } sizes[] = { { 37, 21 }, { 256, 256 }, { 1920, 1080 }, { 3840, 2160 } };
+	uint32_t *bits = (uint32_t *) malloc(3841 * 2160 * 4);
+
+	printf("%-8s %-12s", "kernel", "block");
+	for (int operation = 0; operation < OPERATION_COUNT; operation++) printf(" %10s Mpx/s", operationNames[operation]);
+	printf("\n");
+
+	for (int kernel = 0; kernel < FILL_KERNEL_COUNT; kernel++)
+	{
+		if (!DrawFillKernelSupported((FillKernel) kernel))
+		{
+			printf("%-8s (not supported)\n", kernelNames[kernel]);
+			continue;
+		}
+
+		for (int operation = 0; operation < OPERATION_COUNT; operation++)
+		{
+			if (!Verify((FillKernel) kernel, (Operation) operation))
+			{
+				printf("%-8s FAILED verification of %s\n", kernelNames[kernel], operationNames[operation]);
+				return 1;
+			}
+		}
+
+		DrawSetFillKernel((FillKernel) kernel);
+
+		for (uintptr_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		{
+			int width = sizes[i].width, height = sizes[i].height;
+			char name[32];
+			snprintf(name, sizeof(name), "%dx%d", width, height);
+			printf("%-8s %-12s", kernelNames[kernel], name);
+
+			for (int operation = 0; operation < OPERATION_COUNT; operation++)
+			{
+				// Offset by one pixel so the rows don't start aligned
+				Painter painter = {};
+				painter.clip = RectangleMake(0, width + 1, 0, height);
+				painter.bits = bits;
+				painter.width = painter.stride = width + 1;
+				painter.height = height;
+				Rectangle block = RectangleMake(1, width + 1, 0, height);
+
+				// Repeat until at least 0.2 seconds have passed
+				uint64_t pixels = 0, iterations = 0;
+				double start = SecondsNow(), elapsed;
+
+				do
+				{
+					Draw((Operation) operation, &painter, block, (uint32_t) iterations);
+					pixels += (uint64_t) width * height;
+					iterations++;
+					elapsed = SecondsNow() - start;
+				}
+				while (elapsed < 0.2);
+
+				printf(" %16.1f", pixels / elapsed / 1e6);
+			}
+
+			printf("\n");
+		}
+	}
+
+	free(bits);
+	DrawSetFillKernel(selected);
+	return 0;
+}
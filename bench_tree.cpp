@@ -0,0 +1,827 @@
+// bench_tree.cpp
+// Benchmarks of the element tree on synthetic trees: creating elements, full and partial
+// painting, layout propagating from ElementMove, and merging ElementRepaint damage.
+// windows splits the elements over several windows of tables, to compare painting them
+// one after another with painting them at the same time (UpdateSetThreadCount).
+// form lays out rows of a label and a field with boxes, and counts the measurements each resize
+// and edit needs on top of the ones answered from the cache.
+// replay feeds a recording from EventRecordStart through a window holding the shape (a table
+// unless another is given) and reports how long each recorded batch of events took to handle.
+// Build (Linux): ./build.sh, or g++ -O2 -pthread -DOS_HEADLESS=1 bench_tree.cpp -o bench_tree
+// Usage: bench_tree [chain|fan|grid|table|windows|form|all] [element count, e.g. 10000, 250k, 1m]
+//        bench_tree replay <recording> [chain|fan|grid|table] [element count]
+#define BUILD_EXAMPLE 0
+#include "main.cpp"
+
+#include <chrono>
+#include <algorithm>
+#include <pthread.h>
+
+////////////////////////////////////
+//- Allocation counting
+
+// Count heap allocations (from the library and everything else) by replacing malloc with
+// wrappers around glibc's own allocator. Don't build this with -fsanitize=address.
+#if defined(__GLIBC__)
+extern "C" void *__libc_malloc(size_t bytes);
+extern "C" void *__libc_calloc(size_t count, size_t bytes);
+extern "C" void *__libc_realloc(void *pointer, size_t bytes);
+extern "C" void __libc_free(void *pointer);
+
+std::atomic<uint64_t> allocationCount;
+
+extern "C" void *malloc(size_t bytes)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(bytes);
+}
+
+extern "C" void *calloc(size_t count, size_t bytes)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(count, bytes);
+}
+
+extern "C" void *realloc(void *pointer, size_t bytes)
+{
+	allocationCount.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(pointer, bytes);
+}
+
+extern "C" void free(void *pointer)
+{
+	__libc_free(pointer);
+}
+
+uint64_t AllocationCount() { return allocationCount.load(std::memory_order_relaxed); }
+#else
+uint64_t AllocationCount() { return 0; }
+#endif
+
+////////////////////////////////////
+//- Measurement
+
+double SecondsNow()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Deterministic, so runs are comparable
+uint32_t randomState = 0x12345678;
+
+uint32_t RandomNext()
+{
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 17;
+	randomState ^= randomState << 5;
+	return randomState;
+}
+
+struct Samples
+{
+	double *seconds;
+	size_t count, capacity;
+	uint64_t allocations;	// total over all samples
+};
+
+// A measured operation: call Begin just before it and End just after
+struct Measurement
+{
+	double start;
+	uint64_t allocations;
+};
+
+Measurement MeasureBegin()
+{
+	Measurement measurement;
+	measurement.allocations = AllocationCount();
+	measurement.start = SecondsNow();
+	return measurement;
+}
+
+void SamplesAdd(Samples *samples, double seconds)
+{
+	if (samples->count == samples->capacity)
+	{
+		samples->capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		samples->seconds = (double *) realloc(samples->seconds, sizeof(double) * samples->capacity);
+	}
+
+	samples->seconds[samples->count++] = seconds;
+}
+
+void MeasureEnd(Samples *samples, Measurement measurement)
+{
+	double seconds = SecondsNow() - measurement.start;
+	samples->allocations += AllocationCount() - measurement.allocations;
+	SamplesAdd(samples, seconds);
+}
+
+void SamplesReset(Samples *samples)
+{
+	samples->count = 0;
+	samples->allocations = 0;
+}
+
+double Percentile(Samples *samples, double p)
+{
+	return samples->seconds[(size_t) (p * (samples->count - 1) + 0.5)] * 1e6;
+}
+
+void Report(const char *shape, size_t elementCount, const char *operation, Samples *samples)
+{
+	if (!samples->count) return;
+	std::sort(samples->seconds, samples->seconds + samples->count);
+	printf("%-6s %9zu  %-14s %8zu %10.2f %10.2f %10.2f %10.2f %10.2f\n", shape, elementCount, operation, samples->count,
+			Percentile(samples, 0.5), Percentile(samples, 0.9), Percentile(samples, 0.99), Percentile(samples, 1.0),
+			(double) samples->allocations / samples->count);
+}
+
+////////////////////////////////////
+//- Synthetic trees
+
+enum Shape
+{
+	SHAPE_CHAIN,	// every element has one child, inset by a pixel: a very deep tree
+	SHAPE_FAN,		// one container with every other element as its child, in 8x8 cells: a very wide tree
+	SHAPE_GRID,		// rows of 12x12 cells, as many rows as cells per row
+	SHAPE_TABLE,	// like the grid, but with 72x16 cells that each draw a line of text
+	SHAPE_COUNT,
+};
+
+const char *shapeNames[SHAPE_COUNT] = { "chain", "fan", "grid", "table" };
+
+#define FAN_CELL_SIZE (8)
+#define GRID_CELL_SIZE (12)
+#define TABLE_CELL_WIDTH (72)
+#define TABLE_ROW_HEIGHT (16)
+#define TABLE_TEXT_SIZE (8)
+
+uint32_t ElementColour(Element *element)
+{
+	return (uint32_t) ((uintptr_t) element * 2654435761u) & 0xFFFFFF;
+}
+
+int LeafMessage(Element *element, Message message, int di, void *dp)
+{
+	(void) di;
+
+	if (message == MSG_PAINT)
+	{
+		DrawBlock((Painter *) dp, element->bounds, ElementColour(element));
+	}
+
+	return 0;
+}
+
+int ChainMessage(Element *element, Message message, int di, void *dp)
+{
+	if (message == MSG_LAYOUT && element->childCount)
+	{
+		Rectangle bounds = element->bounds;
+
+		// Stop shrinking once it's small, so arbitrarily deep chains stay visible
+		if (bounds.r - bounds.l > 8 && bounds.b - bounds.t > 8)
+		{
+			bounds = RectangleMake(bounds.l + 1, bounds.r - 1, bounds.t + 1, bounds.b - 1);
+		}
+
+		ElementMove(element->children[0], bounds, false);
+	}
+
+	return LeafMessage(element, message, di, dp);
+}
+
+int FanMessage(Element *element, Message message, int di, void *dp)
+{
+	if (message == MSG_LAYOUT)
+	{
+		Rectangle bounds = element->bounds;
+		int columns = (bounds.r - bounds.l) / FAN_CELL_SIZE;
+		if (columns < 1) columns = 1;
+
+		for (uintptr_t i = 0; i < element->childCount; i++)
+		{
+			int x = bounds.l + (int) (i % columns) * FAN_CELL_SIZE;
+			int y = bounds.t + (int) (i / columns) * FAN_CELL_SIZE;
+			ElementMove(element->children[i], RectangleMake(x, x + FAN_CELL_SIZE - 1, y, y + FAN_CELL_SIZE - 1), false);
+		}
+	}
+
+	return LeafMessage(element, message, di, dp);
+}
+
+// Used for the grid itself, which stacks its rows, and for each row, which lines up its cells
+int GridMessage(Element *element, Message message, int di, void *dp)
+{
+	if (message == MSG_LAYOUT)
+	{
+		Rectangle bounds = element->bounds;
+		bool isRow = element->parent->messageClass == GridMessage;
+
+		for (uintptr_t i = 0; i < element->childCount; i++)
+		{
+			int offset = (int) i * GRID_CELL_SIZE;
+			ElementMove(element->children[i], isRow
+					? RectangleMake(bounds.l + offset, bounds.l + offset + GRID_CELL_SIZE - 1, bounds.t, bounds.b)
+					: RectangleMake(bounds.l, bounds.r, bounds.t + offset, bounds.t + offset + GRID_CELL_SIZE - 1), false);
+		}
+	}
+
+	return LeafMessage(element, message, di, dp);
+}
+
+// The table and its rows, which are laid out like the grid and its rows
+int TableMessage(Element *element, Message message, int di, void *dp)
+{
+	if (message == MSG_LAYOUT)
+	{
+		Rectangle bounds = element->bounds;
+		bool isRow = element->parent->messageClass == TableMessage;
+
+		for (uintptr_t i = 0; i < element->childCount; i++)
+		{
+			ElementMove(element->children[i], isRow
+					? RectangleMake(bounds.l + (int) i * TABLE_CELL_WIDTH, bounds.l + (int) (i + 1) * TABLE_CELL_WIDTH, bounds.t, bounds.b)
+					: RectangleMake(bounds.l, bounds.r, bounds.t + (int) i * TABLE_ROW_HEIGHT, bounds.t + (int) (i + 1) * TABLE_ROW_HEIGHT), false);
+		}
+	}
+	else if (message == MSG_PAINT)
+	{
+		DrawBlock((Painter *) dp, element->bounds, 0xFFFFFF);
+	}
+
+	(void) di;
+	return 0;
+}
+
+// A cell's text is its row and column, so almost every cell draws a different string
+int TableCellMessage(Element *element, Message message, int di, void *dp)
+{
+	(void) di;
+
+	if (message == MSG_PAINT)
+	{
+		char text[32];
+		int bytes = snprintf(text, sizeof(text), "R%u C%u", _ElementIndex(element->parent), _ElementIndex(element));
+		Rectangle bounds = element->bounds;
+		DrawString((Painter *) dp, RectangleMake(bounds.l + 4, bounds.r - 4, bounds.t, bounds.b), text, bytes, 0x202020, TABLE_TEXT_SIZE, TEXT_ALIGN_LEFT);
+	}
+
+	return 0;
+}
+
+// Add elementCount elements to the window, timing each ElementCreate. Returns them all in creation order.
+Element **BuildTree(Window *window, Shape shape, size_t elementCount, Samples *create, uint32_t flags)
+{
+	Element **elements = (Element **) malloc(sizeof(Element *) * elementCount);
+	size_t rowLength = 1;
+	while (rowLength * rowLength < elementCount) rowLength++;
+	Element *parent = &window->e, *row = NULL;
+
+	for (size_t i = 0; i < elementCount; i++)
+	{
+		bool rows = shape == SHAPE_GRID || shape == SHAPE_TABLE;
+		MessageHandler container = shape == SHAPE_FAN ? FanMessage : shape == SHAPE_TABLE ? TableMessage : GridMessage;
+		MessageHandler handler = shape == SHAPE_TABLE ? TableCellMessage : LeafMessage;
+		if (shape == SHAPE_CHAIN) handler = ChainMessage;
+		else if (i == 0) handler = container;
+		else if (rows && (i - 1) % rowLength == 0) handler = container;
+
+		Measurement measurement = MeasureBegin();
+		Element *element = ElementCreate(sizeof(Element), parent, flags, handler);
+		MeasureEnd(create, measurement);
+		elements[i] = element;
+
+		if (shape == SHAPE_CHAIN) parent = element;
+		else if (i == 0) parent = row = element;
+		else if (handler == container) parent = element;
+
+		if (rows && i && (i - 1) % rowLength == rowLength - 1) parent = row;
+	}
+
+	return elements;
+}
+
+////////////////////////////////////
+//- Benchmarks
+
+struct Options
+{
+	bool shapes[SHAPE_COUNT];
+	bool windows, form;
+	size_t elementCount;
+	const char *replayPath;
+};
+
+void RunShape(Shape shape, size_t elementCount)
+{
+	const char *name = shapeNames[shape];
+	Samples samples = {}, paint = {};
+
+	Window *window = WindowCreate("bench_tree", 1920, 1080);
+	MessageLoop();
+
+	SamplesReset(&samples);
+	Element **elements = BuildTree(window, shape, elementCount, &samples, 0);
+	Report(name, elementCount, "create", &samples);
+
+	// The first layout visits everything
+	SamplesReset(&samples);
+	Measurement measurement = MeasureBegin();
+	ElementRelayout(&window->e);
+	_Update();
+	MeasureEnd(&samples, measurement);
+	Report(name, elementCount, "first-frame", &samples);
+
+	SamplesReset(&samples);
+
+	for (int i = 0; i < 10; i++)
+	{
+		ElementRepaint(&window->e, NULL);
+		measurement = MeasureBegin();
+		_Update();
+		MeasureEnd(&samples, measurement);
+	}
+
+	Report(name, elementCount, "paint-full", &samples);
+
+	SamplesReset(&samples);
+
+	for (int i = 0; i < 200; i++)
+	{
+		Element *element = elements[RandomNext() % elementCount];
+		measurement = MeasureBegin();
+		ElementRepaint(element, NULL);
+		_Update();
+		MeasureEnd(&samples, measurement);
+	}
+
+	Report(name, elementCount, "paint-partial", &samples);
+
+	// Move a subtree back and forth by a pixel, so its descendants are all laid out again:
+	// the whole chain below the second element, the whole fan, or a row of the grid
+	uint64_t layoutsBefore = window->layoutCount;
+	SamplesReset(&samples);
+
+	for (int i = 0; i < 50; i++)
+	{
+		Element *target = elements[0];
+		if (shape == SHAPE_CHAIN) target = elements[1];
+		if ((shape == SHAPE_GRID || shape == SHAPE_TABLE) && elements[0]->childCount) target = elements[0]->children[RandomNext() % elements[0]->childCount];
+
+		int dx = i % 2 ? -1 : 1;
+		Rectangle bounds = target->bounds;
+		measurement = MeasureBegin();
+		ElementRepaint(target, NULL);
+		ElementMove(target, RectangleMake(bounds.l + dx, bounds.r + dx, bounds.t, bounds.b), false);
+		ElementRepaint(target, NULL);
+		_Update();
+		MeasureEnd(&samples, measurement);
+	}
+
+	Report(name, elementCount, "move", &samples);
+	uint64_t layoutsPerMove = (window->layoutCount - layoutsBefore) / 50;
+
+	// Scattered repaints, which RegionAdd has to merge into at most REGION_MAX_RECTANGLES
+	int64_t rectangles = 0, area = 0;
+	SamplesReset(&samples);
+	SamplesReset(&paint);
+
+	for (int i = 0; i < 50; i++)
+	{
+		for (int j = 0; j < 100; j++)
+		{
+			Element *element = elements[RandomNext() % elementCount];
+			measurement = MeasureBegin();
+			ElementRepaint(element, NULL);
+			MeasureEnd(&samples, measurement);
+		}
+
+		RegionClip(&window->updateRegion, RectangleMake(0, window->width, 0, window->height));
+		rectangles += window->updateRegion.count;
+		area += RegionArea(&window->updateRegion);
+
+		measurement = MeasureBegin();
+		_Update();
+		MeasureEnd(&paint, measurement);
+	}
+
+	Report(name, elementCount, "repaint-merge", &samples);
+	Report(name, elementCount, "paint-merged", &paint);
+
+	printf("%-6s %9zu  arena %.1f MB reserved, %.1f MB peak; %llu layouts per move; "
+			"merged regions average %.1f rectangles, %lld pixels; overdraw %.2f\n",
+			name, elementCount, window->arena.bytesReserved / 1048576.0, window->arena.bytesPeak / 1048576.0,
+			(unsigned long long) layoutsPerMove, rectangles / 50.0, (long long) (area / 50),
+			(double) window->pixelsPainted / window->pixelsUpdated);
+
+	SamplesReset(&samples);
+	measurement = MeasureBegin();
+	WindowDestroy(window);
+	MeasureEnd(&samples, measurement);
+	Report(name, elementCount, "destroy", &samples);
+
+	free(elements);
+	free(samples.seconds);
+	free(paint.seconds);
+}
+
+#define WINDOW_COUNT (4)
+
+// Repaint every window of tables completely, with 1 (the default, one window after another),
+// 2 and WINDOW_COUNT threads. frame is the time from the start of _Update until each window
+// was presented, which for the last window painted includes waiting for all the others.
+void RunWindows(size_t elementCount)
+{
+	const char *name = "windows";
+	Samples samples = {};
+	Window *windows[WINDOW_COUNT];
+
+	for (int i = 0; i < WINDOW_COUNT; i++)
+	{
+		windows[i] = WindowCreate("bench_tree", 1920, 1080);
+	}
+
+	MessageLoop();
+
+	for (int i = 0; i < WINDOW_COUNT; i++)
+	{
+		free(BuildTree(windows[i], SHAPE_TABLE, elementCount / WINDOW_COUNT, &samples, ELEMENT_PAINT_THREAD_SAFE));
+		ElementRelayout(&windows[i]->e);
+	}
+
+	_Update();
+
+	for (int threads = 1; threads <= WINDOW_COUNT; threads *= 2)
+	{
+		UpdateSetThreadCount(threads);
+		uint64_t paintTime[WINDOW_COUNT] = {}, frameTime[WINDOW_COUNT] = {};
+		SamplesReset(&samples);
+
+		for (int i = 0; i < 20; i++)
+		{
+			for (int j = 0; j < WINDOW_COUNT; j++)
+			{
+				ElementRepaint(&windows[j]->e, NULL);
+			}
+
+			Measurement measurement = MeasureBegin();
+			_Update();
+			MeasureEnd(&samples, measurement);
+
+			for (int j = 0; j < WINDOW_COUNT; j++)
+			{
+				paintTime[j] += windows[j]->paintTime;
+				frameTime[j] += windows[j]->frameTime;
+			}
+		}
+
+		char operation[32];
+		snprintf(operation, sizeof(operation), "update-%d-thread%s", threads, threads == 1 ? "" : "s");
+		Report(name, elementCount, operation, &samples);
+		printf("%-6s %9zu  %d threads, average per window in us:", name, elementCount, threads);
+
+		for (int j = 0; j < WINDOW_COUNT; j++)
+		{
+			printf(" paint %.0f frame %.0f;", paintTime[j] / 20e3, frameTime[j] / 20e3);
+		}
+
+		printf("\n");
+	}
+
+	UpdateSetThreadCount(1);
+
+	for (int i = 0; i < WINDOW_COUNT; i++)
+	{
+		WindowDestroy(windows[i]);
+	}
+
+	free(samples.seconds);
+}
+
+#define FORM_TEXT_SIZE (8)
+#define FORM_ROW_HEIGHT (16)
+#define FORM_FIELD_TEXT_WIDTH (300)	// a field wraps its text onto more lines when it's narrower than this
+
+struct FormLabel
+{
+	Element e;
+	char text[32];
+};
+
+int FormLabelMessage(Element *element, Message message, int di, void *dp)
+{
+	(void) di;
+	FormLabel *label = (FormLabel *) element;
+
+	if (message == MSG_GET_WIDTH)
+	{
+		return MeasureString(label->text, -1, FORM_TEXT_SIZE) + 8;
+	}
+	else if (message == MSG_GET_HEIGHT)
+	{
+		return FORM_ROW_HEIGHT;
+	}
+	else if (message == MSG_PAINT)
+	{
+		DrawString((Painter *) dp, element->bounds, label->text, -1, 0x202020, FORM_TEXT_SIZE, TEXT_ALIGN_LEFT);
+	}
+
+	return 0;
+}
+
+int FormFieldMessage(Element *element, Message message, int di, void *dp)
+{
+	if (message == MSG_GET_WIDTH)
+	{
+		return 100;
+	}
+	else if (message == MSG_GET_HEIGHT)
+	{
+		return di ? FORM_ROW_HEIGHT * ((FORM_FIELD_TEXT_WIDTH + di - 1) / di) : FORM_ROW_HEIGHT;
+	}
+	else if (message == MSG_PAINT)
+	{
+		DrawBlock((Painter *) dp, element->bounds, ElementColour(element));
+	}
+
+	return 0;
+}
+
+int FormBackgroundMessage(Element *element, Message message, int di, void *dp)
+{
+	(void) di;
+
+	if (message == MSG_PAINT)
+	{
+		DrawBlock((Painter *) dp, element->bounds, 0xFFFFFF);
+	}
+
+	return 0;
+}
+
+// A column of rows, each a label and a field that fills the rest of the row, in a window resized by
+// posting events like the platform would. Only the width changes the fields' heights, so resizing
+// the height should need no measurements at all, and an edit only those along its path.
+void RunForm(size_t elementCount)
+{
+	const char *name = "form";
+	Samples samples = {};
+	size_t rowCount = elementCount / 3 ? elementCount / 3 : 1;
+
+	Window *window = WindowCreate("bench_tree", 1920, 1080);
+	MessageLoop();
+
+	Box *form = BoxCreate(&window->e, BOX_COLUMN);
+	form->e.messageUser = FormBackgroundMessage;
+	form->padding = RectangleMake(8, 8, 8, 8);
+	form->gap = 2;
+	FormLabel **labels = (FormLabel **) malloc(sizeof(FormLabel *) * rowCount);
+
+	for (size_t i = 0; i < rowCount; i++)
+	{
+		Box *row = BoxCreate(&form->e, BOX_ROW);
+		row->gap = 4;
+		labels[i] = (FormLabel *) ElementCreate(sizeof(FormLabel), &row->e, 0, FormLabelMessage);
+		snprintf(labels[i]->text, sizeof(labels[i]->text), "Field %zu", i);
+		ElementCreate(sizeof(Element), &row->e, ELEMENT_H_FILL, FormFieldMessage);
+	}
+
+	uint64_t measures = window->measureCount;
+	Measurement measurement = MeasureBegin();
+	ElementRelayout(&window->e);
+	_Update();
+	MeasureEnd(&samples, measurement);
+	Report(name, elementCount, "first-frame", &samples);
+	printf("%-6s %9zu  first frame: %llu measurements\n", name, elementCount, (unsigned long long) (window->measureCount - measures));
+
+	const char *operations[] = { "resize-height", "resize-width", "edit" };
+
+	for (int operation = 0; operation < 3; operation++)
+	{
+		measures = window->measureCount;
+		SamplesReset(&samples);
+
+		for (int i = 0; i < 20; i++)
+		{
+			measurement = MeasureBegin();
+
+			if (operation == 2)
+			{
+				FormLabel *label = labels[RandomNext() % rowCount];
+				snprintf(label->text, sizeof(label->text), i % 2 ? "Edited field %d" : "Field %d", i);
+				ElementRemeasure(&label->e);
+				ElementRepaint(&label->e, NULL);
+				_Update();
+			}
+			else
+			{
+				int width = operation && i % 2 ? 1600 : 1920, height = !operation && i % 2 ? 1000 : 1080;
+				HeadlessPostEvent(window, HEADLESS_EVENT_RESIZE, width, height);
+				MessageLoop();
+			}
+
+			MeasureEnd(&samples, measurement);
+		}
+
+		Report(name, elementCount, operations[operation], &samples);
+		printf("%-6s %9zu  %s: %.1f measurements each\n", name, elementCount, operations[operation],
+				(window->measureCount - measures) / 20.0);
+	}
+
+	free(labels);
+	WindowDestroy(window);
+	free(samples.seconds);
+}
+
+#define REPLAY_SLOWEST (5)
+
+void RunReplay(const char *path, Shape shape, size_t elementCount)
+{
+	const char *name = shapeNames[shape];
+	Samples samples = {}, layout = {}, paint = {}, present = {};
+
+	Window *window = WindowCreate("bench_tree", 1920, 1080);
+	MessageLoop();
+	free(BuildTree(window, shape, elementCount, &samples, 0));
+	ElementRelayout(&window->e);
+	_Update();
+
+	size_t frameCount;
+	ReplayFrame *frames = HeadlessReplay(path, &frameCount);
+
+	if (!frames)
+	{
+		fprintf(stderr, "%s is not an event recording\n", path);
+		WindowDestroy(window);
+		return;
+	}
+
+	SamplesReset(&samples);
+
+	for (size_t i = 0; i < frameCount; i++)
+	{
+		SamplesAdd(&layout, frames[i].layoutTime / 1e9);
+		SamplesAdd(&paint, frames[i].paintTime / 1e9);
+		SamplesAdd(&present, frames[i].presentTime / 1e9);
+		SamplesAdd(&samples, (frames[i].layoutTime + frames[i].paintTime + frames[i].presentTime) / 1e9);
+	}
+
+	Report(name, elementCount, "replay-layout", &layout);
+	Report(name, elementCount, "replay-paint", &paint);
+	Report(name, elementCount, "replay-present", &present);
+	Report(name, elementCount, "replay-batch", &samples);
+
+	// Where in the recording the spikes were, to compare with what the user saw
+	std::sort(frames, frames + frameCount, [] (const ReplayFrame &a, const ReplayFrame &b) {
+		return a.layoutTime + a.paintTime + a.presentTime > b.layoutTime + b.paintTime + b.presentTime;
+	});
+
+	for (size_t i = 0; i < frameCount && i < REPLAY_SLOWEST; i++)
+	{
+		printf("%-6s %9zu  batch at %.3f s: %u events, layout %.0f us, paint %.0f us, present %.0f us, %llu pixels\n",
+				name, elementCount, frames[i].time / 1e9, frames[i].eventCount, frames[i].layoutTime / 1e3,
+				frames[i].paintTime / 1e3, frames[i].presentTime / 1e3, (unsigned long long) frames[i].pixelsPainted);
+	}
+
+	free(frames);
+	WindowDestroy(window);
+	free(samples.seconds);
+	free(layout.seconds);
+	free(paint.seconds);
+	free(present.seconds);
+}
+
+void *RunBenchmarks(void *argument)
+{
+	Options *options = (Options *) argument;
+
+	if (options->replayPath)
+	{
+		printf("%-6s %9s  %-14s %8s %10s %10s %10s %10s %10s\n",
+				"shape", "elements", "operation", "samples", "p50 us", "p90 us", "p99 us", "max us", "allocs/op");
+
+		for (int shape = 0; shape < SHAPE_COUNT; shape++)
+		{
+			if (options->shapes[shape])
+			{
+				RunReplay(options->replayPath, (Shape) shape, options->elementCount);
+			}
+		}
+
+		return NULL;
+	}
+
+	printf("%-6s %9s  %-14s %8s %10s %10s %10s %10s %10s\n",
+			"shape", "elements", "operation", "samples", "p50 us", "p90 us", "p99 us", "max us", "allocs/op");
+
+	for (int shape = 0; shape < SHAPE_COUNT; shape++)
+	{
+		if (options->shapes[shape])
+		{
+			RunShape((Shape) shape, options->elementCount);
+		}
+	}
+
+	if (options->windows)
+	{
+		RunWindows(options->elementCount);
+	}
+
+	if (options->form)
+	{
+		RunForm(options->elementCount);
+	}
+
+	return NULL;
+}
+
+size_t ParseCount(const char *string)
+{
+	char *end;
+	size_t count = strtoull(string, &end, 10);
+	if (*end == 'k' || *end == 'K') count *= 1000;
+	if (*end == 'm' || *end == 'M') count *= 1000000;
+	return count;
+}
+
+int main(int argc, char **argv)
+{
+	Options options = {};
+	options.elementCount = 10000;
+	bool anyShape = false;
+
+	for (int i = 1; i < argc; i++)
+	{
+		bool found = false;
+
+		for (int shape = 0; shape < SHAPE_COUNT; shape++)
+		{
+			if (0 == strcmp(argv[i], shapeNames[shape]))
+			{
+				options.shapes[shape] = found = anyShape = true;
+			}
+		}
+
+		if (0 == strcmp(argv[i], "windows"))
+		{
+			options.windows = found = anyShape = true;
+		}
+
+		if (0 == strcmp(argv[i], "form"))
+		{
+			options.form = found = anyShape = true;
+		}
+
+		if (0 == strcmp(argv[i], "replay") && i + 1 < argc)
+		{
+			options.replayPath = argv[++i];
+			found = true;
+		}
+
+		if (!found && 0 != strcmp(argv[i], "all"))
+		{
+			options.elementCount = ParseCount(argv[i]);
+		}
+	}
+
+	if (!anyShape && options.replayPath)
+	{
+		options.shapes[SHAPE_TABLE] = true;
+	}
+	else if (!anyShape)
+	{
+		for (int shape = 0; shape < SHAPE_COUNT; shape++) options.shapes[shape] = true;
+		options.windows = options.form = true;
+	}
+
+	if (options.elementCount < 2)
+	{
+		fprintf(stderr, "Usage: %s [chain|fan|grid|table|windows|form|all] [element count, at least 2]\n", argv[0]);
+		fprintf(stderr, "       %s replay <recording> [chain|fan|grid|table] [element count, at least 2]\n", argv[0]);
+		return 1;
+	}
+
+	Initialise();
+
+	// Layout and painting walk the tree with their own stacks, but destroying it still
+	// recurses once per level, so a deep chain needs far more than the default stack.
+	// The pages are only committed as they're touched.
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, (size_t) 1 << 30);
+	pthread_t thread;
+
+	if (pthread_create(&thread, &attributes, RunBenchmarks, &options))
+	{
+		RunBenchmarks(&options);
+	}
+	else
+	{
+		pthread_join(thread, NULL);
+	}
+
+	pthread_attr_destroy(&attributes);
+	return 0;
+}
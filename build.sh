@@ -0,0 +1,17 @@
+#!/bin/sh
+# Linux counterpart of build.bat. Everything goes into build/:
+#   main        the example program on X11, with AddressSanitizer
+#   bench_fill  DrawBlock fill kernel micro-benchmark
+#   bench_tree  element tree benchmarks
+#   tests       checks of the library on the headless backend, with AddressSanitizer
+# The benchmarks and tests use the headless backend, so they run without a display.
+
+set -e
+
+mkdir -p build
+cd build
+
+g++ ../main.cpp -fsanitize=address -g -pthread -lX11 -lXext -o main
+g++ ../bench_fill.cpp -O2 -pthread -DOS_HEADLESS=1 -o bench_fill
+g++ ../bench_tree.cpp -O2 -g -pthread -DOS_HEADLESS=1 -o bench_tree
+g++ ../tests.cpp -fsanitize=address -g -pthread -DOS_HEADLESS=1 -o tests
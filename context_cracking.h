@@ -129,6 +129,17 @@
 #endif
 
 
+////////////////////////////////
+// Platform Backend Override
+
+// Building with -DOS_HEADLESS=1 swaps the windowing backend for an in-memory one,
+// so none of the Win32/X11 code is compiled in, whatever the host OS is.
+#if defined(OS_HEADLESS) && OS_HEADLESS
+# undef OS_WINDOWS
+# undef OS_LINUX
+# undef OS_MAC
+#endif
+
 ////////////////////////////////
 // Zero All Undefined Options
 
@@ -168,6 +179,9 @@
 #if !defined(OS_MAC)
 # define OS_MAC 0
 #endif
+#if !defined(OS_HEADLESS)
+# define OS_HEADLESS 0
+#endif
 #if !defined(LANG_CPP)
 # define LANG_CPP 0
 #endif
@@ -182,6 +196,18 @@
 # define BUILD_TITLE "Untitled"
 #endif
 
+// Set to 0 to compile main.cpp as a library only (no test usage code or main()),
+// e.g. when it's #included by a benchmark.
+#if !defined(BUILD_EXAMPLE)
+# define BUILD_EXAMPLE 1
+#endif
+
+// Set to 1 to record the time taken by every message, element paint and window update
+// (see TraceExport). When 0, the tracing code isn't compiled at all.
+#if !defined(ENABLE_TRACING)
+# define ENABLE_TRACING 0
+#endif
+
 ////////////////////////////////
 // Unsupported Errors
 
@@ -7,272 +7,4186 @@
 //- Globals
 GlobalState global;
 
+void _WindowBeginPaint(Window *window);
+void _WindowEndPaint(Window *window, Painter *painter);
+uint32_t _ElementIndex(Element *element);
+int64_t _RectangleArea(Rectangle a);
+void _WindowLayout(Window *window);
+void _ElementMarkLayoutPath(Element *element);
+void _ElementInvalidateDisplayList(Element *element);
+void _DisplayListReplay(DisplayList *list, Painter *painter);
+void _TimersRemoveElement(Element *element);
+uint64_t _TimeNow();
+void _ElementPaintContents(Element *element, Painter *painter, Rectangle clip, Rectangle *fragments, int fragmentCount);
+
+////////////////////////////////////
+//- Tracing
+
+#if ENABLE_TRACING
+uint32_t _TraceThreadID()
+{
+	static thread_local uint32_t id = global.traceThreadCount.fetch_add(1) + 1;
+	return id;
+}
+
+// Records the time from its construction to its destruction as a TraceEvent.
+// If pixelCounter is set, the event also records how much it went up in that time.
+struct _TraceScope
+{
+	const char *name;
+	const void *element;
+	const uint64_t *pixelCounter;
+	uint64_t start, pixelsBefore;
+
+	_TraceScope(const char *name, const void *element, const uint64_t *pixelCounter)
+		: name(name), element(element), pixelCounter(pixelCounter)
+	{
+		pixelsBefore = pixelCounter ? *pixelCounter : 0;
+		start = _TimeNow();
+	}
+
+	~_TraceScope()
+	{
+		uint64_t end = _TimeNow();
+
+		// Each writer claims its own slot, so no locking is needed
+		uint64_t index = global.traceEventCount.fetch_add(1, std::memory_order_relaxed);
+		TraceEvent *event = &global.traceEvents[index & (TRACE_BUFFER_EVENTS - 1)];
+		event->name = name;
+		event->element = element;
+		event->start = start;
+		event->duration = end - start;
+		event->pixels = pixelCounter ? *pixelCounter - pixelsBefore : 0;
+		event->thread = _TraceThreadID();
+	}
+};
+
+#define TRACE_SCOPE(name, element, pixelCounter) _TraceScope _traceScope(name, element, pixelCounter)
+
+const char *_TraceMessageName(Message message)
+{
+	if (message == MSG_PAINT) return "MSG_PAINT";
+	if (message == MSG_LAYOUT) return "MSG_LAYOUT";
+	if (message == MSG_DESTROY) return "MSG_DESTROY";
+	if (message == MSG_TIMER) return "MSG_TIMER";
+	if (message == MSG_GET_WIDTH) return "MSG_GET_WIDTH";
+	if (message == MSG_GET_HEIGHT) return "MSG_GET_HEIGHT";
+	return "MSG_USER";
+}
+
+bool TraceExport(const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+
+	uint64_t total = global.traceEventCount.load();
+	uint64_t count = total < TRACE_BUFFER_EVENTS ? total : TRACE_BUFFER_EVENTS;
+
+	fprintf(f, "{\"traceEvents\":[\n");
+
+	for (uint64_t i = total - count; i < total; i++)
+	{
+		TraceEvent *event = &global.traceEvents[i & (TRACE_BUFFER_EVENTS - 1)];
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+				"\"args\":{\"element\":\"%p\",\"pixels\":%llu}}%s\n",
+				event->name, event->start / 1000.0, event->duration / 1000.0, event->thread,
+				event->element, (unsigned long long) event->pixels, i + 1 == total ? "" : ",");
+	}
+
+	fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+	return fclose(f) == 0;
+}
+
+void TraceClear()
+{
+	global.traceEventCount.store(0);
+}
+#else
+#define TRACE_SCOPE(name, element, pixelCounter)
+
+bool TraceExport(const char *path)
+{
+	(void) path;
+	return false;
+}
+
+void TraceClear()
+{
+}
+#endif
+
+////////////////////////////////////
+//- Thread pool
+
+// The tasks of a job are numbered 0..taskCount-1. Each thread starts with its own contiguous
+// range of task indices, and once that runs out it steals the upper half of another thread's
+// remaining range. begin (low 32 bits) and end (high 32 bits) share one atomic, so the owner
+// popping from the front and thieves stealing from the back never hand out the same task twice.
+struct _WorkQueue
+{
+	std::atomic<uint64_t> range;
+	char padding[64 - sizeof(std::atomic<uint64_t>)];	// one queue per cache line
+};
+
+typedef void (*ThreadPoolTask)(void *context, int index, int thread);
+
+struct ThreadPool
+{
+	std::thread *threads;		// threadCount - 1 workers; thread 0 is whoever calls _ThreadPoolRun
+	int threadCount;
+	_WorkQueue *queues;			// one per thread
+
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	uint64_t generation;		// incremented for every job
+	int busy;					// workers yet to finish the current job
+	bool quit;
+
+	ThreadPoolTask task;
+	void *context;
+};
+
+uint64_t _WorkRange(uint32_t begin, uint32_t end)
+{
+	return ((uint64_t) end << 32) | begin;
+}
+
+bool _WorkQueuePop(_WorkQueue *queue, uint32_t *index)
+{
+	uint64_t range = queue->range.load();
+
+	while (true)
+	{
+		uint32_t begin = (uint32_t) range, end = (uint32_t) (range >> 32);
+		if (begin >= end) return false;
+
+		if (queue->range.compare_exchange_weak(range, _WorkRange(begin + 1, end)))
+		{
+			*index = begin;
+			return true;
+		}
+	}
+}
+
+bool _WorkQueueSteal(_WorkQueue *victim, _WorkQueue *thief)
+{
+	uint64_t range = victim->range.load();
+
+	while (true)
+	{
+		uint32_t begin = (uint32_t) range, end = (uint32_t) (range >> 32);
+		if (begin >= end) return false;
+		uint32_t middle = begin + (end - begin) / 2;
+
+		if (victim->range.compare_exchange_weak(range, _WorkRange(begin, middle)))
+		{
+			// Our own queue is empty, so nobody else will touch it until this store
+			thief->range.store(_WorkRange(middle, end));
+			return true;
+		}
+	}
+}
+
+void _ThreadPoolDrain(ThreadPool *pool, int thread)
+{
+	while (true)
+	{
+		uint32_t index;
+
+		while (_WorkQueuePop(&pool->queues[thread], &index))
+		{
+			pool->task(pool->context, index, thread);
+		}
+
+		bool stole = false;
+
+		for (int i = 1; i < pool->threadCount && !stole; i++)
+		{
+			stole = _WorkQueueSteal(&pool->queues[(thread + i) % pool->threadCount], &pool->queues[thread]);
+		}
+
+		if (!stole)
+		{
+			// Every queue was empty; tasks still running on other threads finish on their own
+			return;
+		}
+	}
+}
+
+void _ThreadPoolWorker(ThreadPool *pool, int thread)
+{
+	uint64_t generation = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(pool->mutex);
+			pool->wake.wait(lock, [&] { return pool->quit || pool->generation != generation; });
+			if (pool->quit) return;
+			generation = pool->generation;
+		}
+
+		_ThreadPoolDrain(pool, thread);
+
+		{
+			std::lock_guard<std::mutex> lock(pool->mutex);
+			if (--pool->busy == 0) pool->done.notify_one();
+		}
+	}
+}
+
+ThreadPool *_ThreadPoolCreate(int threadCount)
+{
+	ThreadPool *pool = new ThreadPool();
+	pool->threadCount = threadCount;
+	pool->queues = new _WorkQueue[threadCount]();
+	pool->threads = new std::thread[threadCount - 1];
+
+	for (int i = 1; i < threadCount; i++)
+	{
+		pool->threads[i - 1] = std::thread(_ThreadPoolWorker, pool, i);
+	}
+
+	return pool;
+}
+
+void _ThreadPoolDestroy(ThreadPool *pool)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->quit = true;
+	}
+
+	pool->wake.notify_all();
+
+	for (int i = 1; i < pool->threadCount; i++)
+	{
+		pool->threads[i - 1].join();
+	}
+
+	delete[] pool->threads;
+	delete[] pool->queues;
+	delete pool;
+}
+
+// Runs task(context, index, thread) for every index in 0..taskCount-1, and returns once they've all finished.
+// The calling thread works on the job too, as thread 0.
+void _ThreadPoolRun(ThreadPool *pool, int taskCount, ThreadPoolTask task, void *context)
+{
+	for (int i = 0; i < pool->threadCount; i++)
+	{
+		uint32_t begin = (uint32_t) ((int64_t) taskCount * i / pool->threadCount);
+		uint32_t end = (uint32_t) ((int64_t) taskCount * (i + 1) / pool->threadCount);
+		pool->queues[i].range.store(_WorkRange(begin, end));
+	}
+
+	pool->task = task;
+	pool->context = context;
+
+	{
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->generation++;
+		pool->busy = pool->threadCount - 1;
+	}
+
+	pool->wake.notify_all();
+	_ThreadPoolDrain(pool, 0);
+
+	std::unique_lock<std::mutex> lock(pool->mutex);
+	pool->done.wait(lock, [&] { return pool->busy == 0; });
+}
+
+////////////////////////////////////
+//- Arena
+
+struct ArenaChunk
+{
+	ArenaChunk *next;
+	ArenaChunk *previous;	// only for dedicated chunks, so ArenaFree can unlink them
+	size_t used, capacity;	// bytes after the header
+};
+
+// Every block starts with a header recording its size class, so ArenaFree knows where it goes
+struct ArenaBlock
+{
+	size_t sizeClass;		// index into freeLists, or ARENA_SIZE_CLASSES for a dedicated chunk
+	size_t bytes;			// including this header
+};
+
+ArenaChunk *_ArenaAddChunk(Arena *arena, size_t capacity)
+{
+	ArenaChunk *chunk = (ArenaChunk *) malloc(sizeof(ArenaChunk) + capacity);
+	chunk->used = 0;
+	chunk->capacity = capacity;
+	arena->bytesReserved += sizeof(ArenaChunk) + capacity;
+	return chunk;
+}
+
+void *ArenaAllocate(Arena *arena, size_t bytes)
+{
+	// Round up to the size class granularity, leaving room for the header
+	bytes = (bytes + sizeof(ArenaBlock) + ARENA_SIZE_CLASS_BYTES - 1) / ARENA_SIZE_CLASS_BYTES * ARENA_SIZE_CLASS_BYTES;
+	size_t sizeClass = bytes / ARENA_SIZE_CLASS_BYTES - 1;
+	ArenaBlock *block;
+
+	if (sizeClass >= ARENA_SIZE_CLASSES)
+	{
+		// Too big to share a chunk. Keep it on its own list, so carving continues in the current chunk.
+		ArenaChunk *chunk = _ArenaAddChunk(arena, bytes);
+		chunk->previous = NULL;
+		chunk->next = arena->dedicated;
+		if (arena->dedicated) arena->dedicated->previous = chunk;
+		arena->dedicated = chunk;
+		chunk->used = bytes;
+		block = (ArenaBlock *) (chunk + 1);
+		sizeClass = ARENA_SIZE_CLASSES;
+	}
+	else if (arena->freeLists[sizeClass])
+	{
+		// Reuse a freed block of the same size class; the next pointer is stored in its first bytes
+		block = (ArenaBlock *) arena->freeLists[sizeClass];
+		arena->freeLists[sizeClass] = *(void **) block;
+	}
+	else
+	{
+		if (!arena->chunks || arena->chunks->capacity - arena->chunks->used < bytes)
+		{
+			ArenaChunk *chunk = _ArenaAddChunk(arena, ARENA_CHUNK_BYTES);
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+
+		block = (ArenaBlock *) ((uint8_t *) (arena->chunks + 1) + arena->chunks->used);
+		arena->chunks->used += bytes;
+	}
+
+	memset(block, 0, bytes);
+	block->sizeClass = sizeClass;
+	block->bytes = bytes;
+
+	arena->bytesLive += bytes;
+	if (arena->bytesPeak < arena->bytesLive) arena->bytesPeak = arena->bytesLive;
+
+	return block + 1;
+}
+
+void ArenaFree(Arena *arena, void *pointer)
+{
+	if (!pointer) return;
+
+	ArenaBlock *block = (ArenaBlock *) pointer - 1;
+	arena->bytesLive -= block->bytes;
+
+	if (block->sizeClass < ARENA_SIZE_CLASSES)
+	{
+		*(void **) block = arena->freeLists[block->sizeClass];
+		arena->freeLists[block->sizeClass] = block;
+	}
+	else
+	{
+		// The block is the whole of a dedicated chunk, straight after its header
+		ArenaChunk *chunk = (ArenaChunk *) block - 1;
+		if (chunk->previous) chunk->previous->next = chunk->next;
+		else arena->dedicated = chunk->next;
+		if (chunk->next) chunk->next->previous = chunk->previous;
+		arena->bytesReserved -= sizeof(ArenaChunk) + chunk->capacity;
+		free(chunk);
+	}
+}
+
+void ArenaRelease(Arena *arena)
+{
+	ArenaChunk *lists[2] = { arena->chunks, arena->dedicated };
+
+	for (int i = 0; i < 2; i++)
+	{
+		ArenaChunk *chunk = lists[i];
+
+		while (chunk)
+		{
+			ArenaChunk *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+	}
+
+	*arena = {};
+}
+
+////////////////////////////////////
+//- Spatial index
+
+void _SpatialCellRange(SpatialIndex *index, Rectangle r, int *c0, int *c1, int *r0, int *r1)
+{
+	r = RectangleIntersection(r, index->bounds);
+	*c0 = (r.l - index->bounds.l) / SPATIAL_CELL_SIZE;
+	*r0 = (r.t - index->bounds.t) / SPATIAL_CELL_SIZE;
+	*c1 = (r.r - 1 - index->bounds.l) / SPATIAL_CELL_SIZE;
+	*r1 = (r.b - 1 - index->bounds.t) / SPATIAL_CELL_SIZE;
+}
+
+void _SpatialIndexAdd(SpatialIndex *index, Rectangle clip, uint32_t child)
+{
+	if (!_RectangleArea(RectangleIntersection(clip, index->bounds))) return;
+
+	int c0, c1, r0, r1;
+	_SpatialCellRange(index, clip, &c0, &c1, &r0, &r1);
+
+	for (int row = r0; row <= r1; row++)
+	{
+		for (int column = c0; column <= c1; column++)
+		{
+			SpatialCell *cell = &index->cells[row * index->columns + column];
+
+			if (cell->count == cell->capacity)
+			{
+				cell->capacity = cell->capacity ? cell->capacity * 2 : 8;
+				cell->children = (uint32_t *) realloc(cell->children, sizeof(uint32_t) * cell->capacity);
+			}
+
+			cell->children[cell->count++] = child;
+		}
+	}
+}
+
+// Remove child from the cells under clip, returning its index in the container's
+// children array, or -1 if it wasn't in any of those cells.
+int64_t _SpatialIndexRemove(Element *container, Rectangle clip, Element *child)
+{
+	SpatialIndex *index = container->spatialIndex;
+	int64_t found = -1;
+
+	if (!_RectangleArea(RectangleIntersection(clip, index->bounds))) return found;
+
+	int c0, c1, r0, r1;
+	_SpatialCellRange(index, clip, &c0, &c1, &r0, &r1);
+
+	for (int row = r0; row <= r1; row++)
+	{
+		for (int column = c0; column <= c1; column++)
+		{
+			SpatialCell *cell = &index->cells[row * index->columns + column];
+
+			for (uint32_t i = 0; i < cell->count; i++)
+			{
+				if (container->children[cell->children[i]] == child)
+				{
+					found = cell->children[i];
+					cell->children[i] = cell->children[--cell->count];
+					break;
+				}
+			}
+		}
+	}
+
+	return found;
+}
+
+void _SpatialIndexFree(SpatialIndex *index)
+{
+	if (!index) return;
+
+	for (int i = 0; i < index->columns * index->rows; i++)
+	{
+		free(index->cells[i].children);
+	}
+
+	free(index->cells);
+	free(index);
+}
+
+void _SpatialIndexBuild(Element *container)
+{
+	SpatialIndex *index = container->spatialIndex;
+	int columns = (container->clip.r - container->clip.l + SPATIAL_CELL_SIZE - 1) / SPATIAL_CELL_SIZE;
+	int rows = (container->clip.b - container->clip.t + SPATIAL_CELL_SIZE - 1) / SPATIAL_CELL_SIZE;
+	if (columns < 1) columns = 1;
+	if (rows < 1) rows = 1;
+
+	if (!index || index->columns != columns || index->rows != rows)
+	{
+		_SpatialIndexFree(index);
+		index = container->spatialIndex = (SpatialIndex *) calloc(1, sizeof(SpatialIndex));
+		index->columns = columns;
+		index->rows = rows;
+		index->cells = (SpatialCell *) calloc(columns * rows, sizeof(SpatialCell));
+	}
+	else
+	{
+		for (int i = 0; i < columns * rows; i++)
+		{
+			index->cells[i].count = 0;
+		}
+	}
+
+	index->bounds = container->clip;
+	index->dirty = false;
+
+	Rectangle *clips = container->window->store.clips;
+
+	for (uint32_t i = 0; i < container->childCount; i++)
+	{
+		_SpatialIndexAdd(index, clips[container->childHandles[i]], i);
+	}
+}
+
+int _CompareIndices(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+// Indices of the children whose clip overlaps r, in paint order. The caller frees the array.
+// Must not be called from several threads while the index is dirty; the serial
+// _ElementPaintThreadSafe pass runs the same queries first, which cleans them.
+uint32_t *_SpatialIndexQuery(Element *container, Rectangle r, uint32_t *count)
+{
+	if (!container->spatialIndex || container->spatialIndex->dirty)
+	{
+		_SpatialIndexBuild(container);
+	}
+
+	SpatialIndex *index = container->spatialIndex;
+	*count = 0;
+
+	if (!_RectangleArea(RectangleIntersection(r, index->bounds)))
+	{
+		return NULL;
+	}
+
+	int c0, c1, r0, r1;
+	_SpatialCellRange(index, r, &c0, &c1, &r0, &r1);
+
+	uint32_t total = 0;
+
+	for (int row = r0; row <= r1; row++)
+	{
+		for (int column = c0; column <= c1; column++)
+		{
+			total += index->cells[row * index->columns + column].count;
+		}
+	}
+
+	uint32_t *result = (uint32_t *) malloc(sizeof(uint32_t) * (total + 1));
+	Rectangle *clips = container->window->store.clips;
+
+	for (int row = r0; row <= r1; row++)
+	{
+		for (int column = c0; column <= c1; column++)
+		{
+			SpatialCell *cell = &index->cells[row * index->columns + column];
+
+			for (uint32_t i = 0; i < cell->count; i++)
+			{
+				// Cells are coarse, so check the child really overlaps
+				if (_RectangleArea(RectangleIntersection(clips[container->childHandles[cell->children[i]]], r)))
+				{
+					result[(*count)++] = cell->children[i];
+				}
+			}
+		}
+	}
+
+	// Children spanning several cells appear more than once
+	qsort(result, *count, sizeof(uint32_t), _CompareIndices);
+	uint32_t unique = 0;
+
+	for (uint32_t i = 0; i < *count; i++)
+	{
+		if (!unique || result[unique - 1] != result[i])
+		{
+			result[unique++] = result[i];
+		}
+	}
+
+	*count = unique;
+	return result;
+}
+
+void _SpatialIndexInvalidate(Element *container)
+{
+	if (container && container->spatialIndex)
+	{
+		container->spatialIndex->dirty = true;
+	}
+}
+
+////////////////////////////////////
+//- Layers
+
+void _LayerUnlink(Layer *layer)
+{
+	if (layer->previous) layer->previous->next = layer->next;
+	else global.layers = layer->next;
+	if (layer->next) layer->next->previous = layer->previous;
+	else global.layersLast = layer->previous;
+	layer->previous = layer->next = NULL;
+}
+
+void _LayerLinkFront(Layer *layer)
+{
+	layer->next = global.layers;
+	layer->previous = NULL;
+	if (global.layers) global.layers->previous = layer;
+	else global.layersLast = layer;
+	global.layers = layer;
+}
+
+void _LayerFreeBits(Layer *layer)
+{
+	if (!layer->bits) return;
+	global.layerBytes -= (size_t) _RectangleArea(layer->bounds) * 4;
+	free(layer->bits);
+	layer->bits = NULL;
+	_LayerUnlink(layer);
+}
+
+// Free least recently used bitmaps until bytes more would fit in the budget.
+// Layers composited this frame are kept, even if that means going over.
+void _LayerEvict(size_t bytes)
+{
+	Layer *layer = global.layersLast;
+
+	while (layer && global.layerBytes + bytes > global.layerBudget)
+	{
+		Layer *previous = layer->previous;
+
+		if (layer->lastUsed != global.layerFrame)
+		{
+			_LayerFreeBits(layer);
+			global.layerEvictionCount++;
+		}
+
+		layer = previous;
+	}
+}
+
+void PaintSetLayerBudget(size_t bytes)
+{
+	global.layerBudget = bytes;
+	_LayerEvict(0);
+}
+
+// Add r to the dirty region of every layer the element is inside (including its own)
+void _ElementDamageLayers(Element *element, Rectangle r)
+{
+	if (!global.layerCount) return;
+
+	for (Element *ancestor = element; ancestor; ancestor = ancestor->parent)
+	{
+		if (ancestor->layer && ancestor->layer->bits)
+		{
+			RegionAdd(&ancestor->layer->dirty, RectangleIntersection(r, ancestor->layer->bounds));
+		}
+	}
+}
+
+void _LayerDestroy(Element *element)
+{
+	if (!element->layer) return;
+	_LayerFreeBits(element->layer);
+	free(element->layer);
+	element->layer = NULL;
+	global.layerCount--;
+}
+
+// Make the layer's bitmap match the element's clip and repaint its dirty parts.
+// Returns false if there's nothing to composite.
+bool _LayerUpdate(Element *element)
+{
+	Rectangle clip = element->clip;
+	if (!_RectangleArea(clip)) return false;
+
+	Layer *layer = element->layer;
+
+	if (layer && layer->bits && layer->lastUsed == global.layerFrame && !layer->dirty.count && RectangleEquals(layer->bounds, clip))
+	{
+		// Already brought up to date this frame. This is the only path the paint threads take,
+		// since _ElementPaintThreadSafe updates every layer they'll touch, so it mustn't write anything.
+		return true;
+	}
+
+	if (!layer)
+	{
+		layer = element->layer = (Layer *) calloc(1, sizeof(Layer));
+		global.layerCount++;
+	}
+
+	int width = clip.r - clip.l;
+
+	if (!layer->bits || !RectangleEquals(layer->bounds, clip))
+	{
+		_LayerFreeBits(layer);
+		size_t bytes = (size_t) _RectangleArea(clip) * 4;
+		_LayerEvict(bytes);
+		layer->bits = (uint32_t *) malloc(bytes);
+		layer->bounds = clip;
+		layer->dirty.count = 0;
+		RegionAdd(&layer->dirty, clip);
+		global.layerBytes += bytes;
+		_LayerLinkFront(layer);
+	}
+	else
+	{
+		_LayerUnlink(layer);
+		_LayerLinkFront(layer);
+	}
+
+	layer->lastUsed = global.layerFrame;
+
+	if (layer->dirty.count)
+	{
+		// Paint in window coordinates, by biasing bits so that bits[y * width + x]
+		// lands on the layer's pixel for window pixel (x, y)
+		Painter painter = {};
+		painter.bits = layer->bits - ((ptrdiff_t) clip.t * width + clip.l);
+		painter.width = width;
+		painter.stride = width;
+		painter.height = clip.b;
+		painter.stack = &element->window->paintStack;
+
+		for (int i = 0; i < layer->dirty.count; i++)
+		{
+			_ElementPaintContents(element, &painter, layer->dirty.rectangles[i], &layer->dirty.rectangles[i], 1);
+		}
+
+		layer->dirty.count = 0;
+		element->window->paintVisits += painter.elementsVisited;
+	}
+
+	return true;
+}
+
+// Copy the parts of the layer inside the fragments to the painter's bits
+void _LayerComposite(Element *element, Painter *painter, Rectangle *fragments, int fragmentCount)
+{
+	if (!_LayerUpdate(element)) return;
+
+	Layer *layer = element->layer;
+	int width = layer->bounds.r - layer->bounds.l;
+
+	for (int i = 0; i < fragmentCount; i++)
+	{
+		Rectangle r = RectangleIntersection(fragments[i], layer->bounds);
+		if (!_RectangleArea(r)) continue;
+
+		for (int y = r.t; y < r.b; y++)
+		{
+			memcpy(&painter->bits[(ptrdiff_t) y * painter->stride + r.l],
+				&layer->bits[(y - layer->bounds.t) * width + (r.l - layer->bounds.l)],
+				(r.r - r.l) * 4);
+		}
+
+		painter->pixelsPainted += _RectangleArea(r);
+	}
+}
+
+////////////////////////////////////
+//- Element store
+
+// Copy the element's clip and flags into the window's store.
+// Called whenever the framework changes either of them.
+void _ElementSync(Element *element)
+{
+	ElementStore *store = &element->window->store;
+	ElementHandle handle = element->handle;
+	store->clips[handle] = element->clip;
+	store->flags[handle] = element->flags;
+}
+
+// The layout passes only change flags, and they run for every element that moves
+void _ElementSyncFlags(Element *element)
+{
+	element->window->store.flags[element->handle] = element->flags;
+}
+
+void _ElementStoreAdd(Element *element)
+{
+	ElementStore *store = &element->window->store;
+
+	if (store->freeCount)
+	{
+		element->handle = store->freeHandles[--store->freeCount];
+	}
+	else
+	{
+		if (store->count == store->capacity)
+		{
+			store->capacity = store->capacity ? store->capacity * 2 : 64;
+			store->clips = (Rectangle *) realloc(store->clips, sizeof(Rectangle) * store->capacity);
+			store->flags = (uint32_t *) realloc(store->flags, sizeof(uint32_t) * store->capacity);
+			store->elements = (Element **) realloc(store->elements, sizeof(Element *) * store->capacity);
+		}
+
+		element->handle = store->count++;
+	}
+
+	store->elements[element->handle] = element;
+	_ElementSync(element);
+}
+
+void _ElementStoreRemove(Element *element)
+{
+	ElementStore *store = &element->window->store;
+	ElementHandle handle = element->handle;
+	store->clips[handle] = {};
+	store->flags[handle] = 0;
+	store->elements[handle] = NULL;
+
+	if (store->freeCount == store->freeCapacity)
+	{
+		store->freeCapacity = store->freeCapacity ? store->freeCapacity * 2 : 64;
+		store->freeHandles = (ElementHandle *) realloc(store->freeHandles, sizeof(ElementHandle) * store->freeCapacity);
+	}
+
+	store->freeHandles[store->freeCount++] = handle;
+}
+
+void _ElementStoreFree(ElementStore *store)
+{
+	free(store->clips);
+	free(store->flags);
+	free(store->elements);
+	free(store->freeHandles);
+	*store = {};
+}
+
+ElementHandle ElementGetHandle(Element *element)
+{
+	return element->handle;
+}
+
+Element *ElementFromHandle(Window *window, ElementHandle handle)
+{
+	return handle < window->store.count ? window->store.elements[handle] : NULL;
+}
+
+////////////////////////////////////
+//- Core UI Logic
+
+// Hint that the walk is about to read pointer, so it's on its way while we finish the current element
+void _Prefetch(const void *pointer)
+{
+#if COMPILER_MSVC && ARCH_X64
+	_mm_prefetch((const char *) pointer, _MM_HINT_T0);
+#elif !COMPILER_MSVC
+	__builtin_prefetch(pointer);
+#else
+	(void) pointer;
+#endif
+}
+
+void _PaintStackReserve(PaintStack *stack, uint32_t count)
+{
+	if (stack->count + count <= stack->capacity) return;
+	stack->capacity = stack->capacity * 2 > stack->count + count ? stack->capacity * 2 : stack->count + count + 64;
+	stack->entries = (PaintStackEntry *) realloc(stack->entries, sizeof(PaintStackEntry) * stack->capacity);
+}
+
+void _PaintStackPush(PaintStack *stack, Element *element, Rectangle clip, uint32_t depth)
+{
+	_PaintStackReserve(stack, 1);
+	stack->entries[stack->count++] = { element, clip, depth };
+}
+
+// Push the children of element that overlap clip, last first, so they come off the stack in order.
+// The children's clips are checked in the store, so the ones outside aren't touched.
+void _PaintStackPushChildren(PaintStack *stack, Element *element, Rectangle clip, uint32_t depth)
+{
+	uint32_t count = element->childCount;
+	uint32_t *indices = NULL;
+
+	if (element->flags & ELEMENT_SPATIAL_INDEX)
+	{
+		// Only the children the grid says overlap the clip
+		indices = _SpatialIndexQuery(element, clip, &count);
+	}
+
+	_PaintStackReserve(stack, count);
+	Rectangle *clips = element->window->store.clips;
+	uint32_t first = stack->count;
+
+	for (uint32_t i = count; i > 0; i--)
+	{
+		uint32_t index = indices ? indices[i - 1] : i - 1;
+		if (!RectangleValid(RectangleIntersection(clips[element->childHandles[index]], clip))) continue;
+		stack->entries[stack->count++] = { element->children[index], clip, depth };
+	}
+
+	if (stack->count > first)
+	{
+		_Prefetch(stack->entries[stack->count - 1].element);
+	}
+
+	free(indices);
+}
+
+// Take the next element off the stack, unless it's down to base. Walks nest (e.g. repainting
+// a layer in the middle of a paint), and each one only pops what it pushed.
+bool _PaintStackPop(PaintStack *stack, uint32_t base, PaintStackEntry *entry)
+{
+	if (stack->count == base) return false;
+	*entry = stack->entries[--stack->count];
+
+	if (stack->count > base)
+	{
+		_Prefetch(stack->entries[stack->count - 1].element);
+	}
+
+	return true;
+}
+
+// Find the opaque elements inside area, numbering every element the same way _ElementPaint will visit them
+void _ElementCollectOccluders(Element *root, Rectangle area, OcclusionList *list, PaintStack *stack)
+{
+	uint32_t base = stack->count;
+	_PaintStackPush(stack, root, area, 0);
+	PaintStackEntry entry;
+
+	while (_PaintStackPop(stack, base, &entry))
+	{
+		Element *element = entry.element;
+		Rectangle clip = RectangleIntersection(element->clip, entry.clip);
+
+		if (!RectangleValid(clip))
+		{
+			continue;
+		}
+
+		uint32_t order = list->order++;
+
+		if ((element->flags & ELEMENT_OPAQUE) && _RectangleArea(clip))
+		{
+			if (list->count == list->capacity)
+			{
+				list->capacity = list->capacity ? list->capacity * 2 : 16;
+				list->occluders = (Occluder *) realloc(list->occluders, sizeof(Occluder) * list->capacity);
+			}
+
+			list->occluders[list->count++] = { clip, order };
+		}
+
+		// A layer's descendants are composited with it, not visited by the paint walk
+		if (~element->flags & ELEMENT_LAYER)
+		{
+			_PaintStackPushChildren(stack, element, clip, entry.depth + 1);
+		}
+	}
+}
+
+// Cut the parts covered by opaque elements painted after this one (order) out of clip.
+// Returns the number of fragments left; 0 means the element is completely hidden.
+// Painting too much is harmless, so occluders that would split clip into too many pieces are ignored.
+int _OcclusionSubtract(OcclusionList *list, uint32_t order, Rectangle clip, Rectangle *fragments)
+{
+	int count = 1;
+	fragments[0] = clip;
+
+	// The walk only moves forward, so occluders at or before this element can be skipped for good
+	while (list->first < list->count && list->occluders[list->first].order <= order)
+	{
+		list->first++;
+	}
+
+	for (uint32_t i = list->first; i < list->count && count; i++)
+	{
+		Rectangle o = list->occluders[i].rectangle;
+		Rectangle pieces[PAINT_MAX_FRAGMENTS];
+		int pieceCount = 0;
+		bool overflow = false;
+
+		for (int j = 0; j < count && !overflow; j++)
+		{
+			Rectangle f = fragments[j];
+
+			if (!_RectangleArea(RectangleIntersection(f, o)))
+			{
+				if (pieceCount == PAINT_MAX_FRAGMENTS) overflow = true;
+				else pieces[pieceCount++] = f;
+				continue;
+			}
+
+			// f minus o: the bands above and below o, then the parts left and right of o between them
+			Rectangle cut[4] = {
+				RectangleMake(f.l, f.r, f.t, o.t),
+				RectangleMake(f.l, f.r, o.b, f.b),
+				RectangleMake(f.l, o.l, o.t > f.t ? o.t : f.t, o.b < f.b ? o.b : f.b),
+				RectangleMake(o.r, f.r, o.t > f.t ? o.t : f.t, o.b < f.b ? o.b : f.b),
+			};
+
+			for (int k = 0; k < 4 && !overflow; k++)
+			{
+				if (!_RectangleArea(cut[k])) continue;
+				if (pieceCount == PAINT_MAX_FRAGMENTS) overflow = true;
+				else pieces[pieceCount++] = cut[k];
+			}
+		}
+
+		if (!overflow)
+		{
+			memcpy(fragments, pieces, sizeof(Rectangle) * pieceCount);
+			count = pieceCount;
+		}
+	}
+
+	return count;
+}
+
+// Send MSG_PAINT with a painter that records instead of drawing. The clip is the element's
+// whole visible area rather than the area being repainted, so the list can be replayed
+// for any part of the element later.
+void _ElementRecord(Element *element, Painter *target)
+{
+	if (!element->displayList)
+	{
+		element->displayList = (DisplayList *) calloc(1, sizeof(DisplayList));
+	}
+
+	Painter recorder = *target;
+	recorder.clip = element->clip;
+	recorder.recording = element->displayList;
+	element->displayList->bytes = 0;
+	ElementMessage(element, MSG_PAINT, 0, &recorder);
+	element->displayList->valid = true;
+}
+
+void _ElementPaintRetained(Element *element, Painter *painter)
+{
+	if (!element->displayList || !element->displayList->valid)
+	{
+		_ElementRecord(element, painter);
+	}
+
+	_DisplayListReplay(element->displayList, painter);
+}
+
+// Paint the element where it isn't covered (fragments)
+void _ElementPaintFragments(Element *element, Painter *painter, Rectangle *fragments, int fragmentCount)
+{
+	for (int i = 0; i < fragmentCount; i++)
+	{
+		painter->clip = fragments[i];
+
+		if (element->flags & ELEMENT_RETAINED)
+		{
+			_ElementPaintRetained(element, painter);
+		}
+		else
+		{
+			ElementMessage(element, MSG_PAINT, 0, painter);
+		}
+	}
+}
+
+// Paint the elements on the painter's stack above base, and everything inside them
+void _PaintWalk(Painter *painter, uint32_t base)
+{
+	PaintStack *stack = painter->stack;
+	PaintStackEntry entry;
+
+	while (_PaintStackPop(stack, base, &entry))
+	{
+		Element *element = entry.element;
+
+		// Compute the intersection of where the element is allowed to draw, element->clip,
+		// with the area its parent was asked to draw
+		Rectangle clip = RectangleIntersection(element->clip, entry.clip);
+
+		// If the above regions do not overlap, skip the element
+		// and do not push our descendant elements
+		// (since their clip rectangles are contained within element->clip)
+		if (!RectangleValid(clip))
+		{
+			continue;
+		}
+
+		TRACE_SCOPE("ElementPaint", element, &painter->pixelsPainted);
+		painter->elementsVisited++;
+		if (entry.depth > painter->depthMax) painter->depthMax = entry.depth;
+
+		// Only paint where the element won't be covered up
+		Rectangle fragments[PAINT_MAX_FRAGMENTS] = { clip };
+		int fragmentCount = 1;
+
+		if (painter->occlusion)
+		{
+			fragmentCount = _OcclusionSubtract(painter->occlusion, painter->occlusion->order++, clip, fragments);
+			if (!fragmentCount) painter->paintsCulled++;
+		}
+
+		if (element->flags & ELEMENT_LAYER)
+		{
+			// The whole subtree comes from the layer's bitmap
+			_LayerComposite(element, painter, fragments, fragmentCount);
+		}
+		else
+		{
+			_ElementPaintFragments(element, painter, fragments, fragmentCount);
+			_PaintStackPushChildren(stack, element, clip, entry.depth + 1);
+		}
+	}
+}
+
+// Paint the element where it isn't covered (fragments), then its descendants inside clip
+void _ElementPaintContents(Element *element, Painter *painter, Rectangle clip, Rectangle *fragments, int fragmentCount)
+{
+	_ElementPaintFragments(element, painter, fragments, fragmentCount);
+	uint32_t base = painter->stack->count;
+	_PaintStackPushChildren(painter->stack, element, clip, 1);
+	_PaintWalk(painter, base);
+}
+
+// Paint the element and its descendants inside painter->clip
+void _ElementPaint(Element *element, Painter *painter)
+{
+	uint32_t base = painter->stack->count;
+	_PaintStackPush(painter->stack, element, painter->clip, 0);
+	_PaintWalk(painter, base);
+}
+
+// Paint everything inside clip, skipping what's hidden under opaque elements
+void _PaintRectangle(Window *window, Painter *painter, Rectangle clip)
+{
+	OcclusionList list = {};
+
+	if (window->opaqueCount)
+	{
+		_ElementCollectOccluders(&window->e, clip, &list, painter->stack);
+		list.order = 0;
+	}
+
+	painter->occlusion = list.count ? &list : NULL;
+	painter->clip = clip;
+	_ElementPaint(&window->e, painter);
+	painter->occlusion = NULL;
+
+	free(list.occluders);
+}
+
+// Can the part of the subtree inside area be painted from several threads at once?
+// Also does the work that mustn't happen on the paint threads, like recording display lists.
+bool _ElementPaintThreadSafe(Element *root, Rectangle area)
+{
+	PaintStack *stack = &root->window->paintStack;
+	uint32_t base = stack->count;
+	_PaintStackPush(stack, root, area, 0);
+	PaintStackEntry entry;
+
+	while (_PaintStackPop(stack, base, &entry))
+	{
+		Element *element = entry.element;
+		Rectangle clip = RectangleIntersection(element->clip, entry.clip);
+
+		if (!RectangleValid(clip))
+		{
+			continue;
+		}
+
+		if (element->flags & ELEMENT_LAYER)
+		{
+			// Repaint the layer now, on this thread; the paint threads only copy from it
+			_LayerUpdate(element);
+			continue;
+		}
+
+		if (~element->flags & ELEMENT_PAINT_THREAD_SAFE)
+		{
+			stack->count = base;
+			return false;
+		}
+
+		if ((element->flags & ELEMENT_RETAINED) && (!element->displayList || !element->displayList->valid))
+		{
+			// Record now, so the paint threads only ever replay
+			Painter painter = {};
+			painter.bits = element->window->bits;
+			painter.width = element->window->width;
+			painter.stride = element->window->stride;
+			painter.height = element->window->height;
+			_ElementRecord(element, &painter);
+		}
+
+		// This also rebuilds the spatial index if needed, before the paint threads query it
+		_PaintStackPushChildren(stack, element, clip, entry.depth + 1);
+	}
+
+	return true;
+}
+
+Painter _WindowPainter(Window *window)
+{
+	Painter painter = {};
+	painter.bits = window->bits;
+	painter.width = window->width;
+	painter.stride = window->stride;
+	painter.height = window->height;
+	painter.stack = &window->paintStack;
+	return painter;
+}
+
+void _PaintTileTask(void *context, int index, int thread)
+{
+	Window *window = (Window *) context;
+	PaintTile *tile = &global.tiles[index];
+	Painter painter = _WindowPainter(window);
+	painter.stack = &global.tileStacks[thread];
+	_PaintRectangle(window, &painter, tile->clip);
+	tile->pixelsPainted = painter.pixelsPainted;
+	tile->paintsCulled = painter.paintsCulled;
+	tile->elementsVisited = painter.elementsVisited;
+	tile->depthMax = painter.depthMax;
+}
+
+// Split the update region into tiles and paint them on the thread pool.
+// Returns false if it's not worth it, or not allowed, in which case nothing was painted.
+bool _PaintTiled(Window *window)
+{
+	if (!global.paintPool)
+	{
+		return false;
+	}
+
+	// Cut every rectangle of the region along a grid of PAINT_TILE_SIZE cells,
+	// so neighbouring tiles from different rectangles line up
+	size_t tileCount = 0;
+
+	for (int i = 0; i < window->updateRegion.count; i++)
+	{
+		Rectangle r = window->updateRegion.rectangles[i];
+
+		if (!_ElementPaintThreadSafe(&window->e, r))
+		{
+			return false;
+		}
+
+		for (int y = r.t / PAINT_TILE_SIZE * PAINT_TILE_SIZE; y < r.b; y += PAINT_TILE_SIZE)
+		{
+			for (int x = r.l / PAINT_TILE_SIZE * PAINT_TILE_SIZE; x < r.r; x += PAINT_TILE_SIZE)
+			{
+				if (tileCount == global.tileCapacity)
+				{
+					global.tileCapacity = global.tileCapacity ? global.tileCapacity * 2 : 64;
+					global.tiles = (PaintTile *) realloc(global.tiles, sizeof(PaintTile) * global.tileCapacity);
+				}
+
+				Rectangle cell = RectangleMake(x, x + PAINT_TILE_SIZE, y, y + PAINT_TILE_SIZE);
+				global.tiles[tileCount++].clip = RectangleIntersection(cell, r);
+			}
+		}
+	}
+
+	if (tileCount < 2)
+	{
+		return false;
+	}
+
+	_ThreadPoolRun(global.paintPool, (int) tileCount, _PaintTileTask, window);
+
+	for (size_t i = 0; i < tileCount; i++)
+	{
+		window->pixelsPainted += global.tiles[i].pixelsPainted;
+		window->paintsCulled += global.tiles[i].paintsCulled;
+		window->paintVisits += global.tiles[i].elementsVisited;
+		if (global.tiles[i].depthMax > window->paintDepthMax) window->paintDepthMax = global.tiles[i].depthMax;
+	}
+
+	return true;
+}
+
+void PaintSetThreadCount(int threadCount)
+{
+	if (global.paintPool)
+	{
+		for (int i = 0; i < global.paintPool->threadCount; i++)
+		{
+			free(global.tileStacks[i].entries);
+		}
+
+		free(global.tileStacks);
+		global.tileStacks = NULL;
+		_ThreadPoolDestroy(global.paintPool);
+		global.paintPool = NULL;
+	}
+
+	if (threadCount > 1)
+	{
+		global.paintPool = _ThreadPoolCreate(threadCount);
+		global.tileStacks = (PaintStack *) calloc(threadCount, sizeof(PaintStack));
+	}
+}
+
+void UpdateSetThreadCount(int threadCount)
+{
+	if (global.updatePool)
+	{
+		_ThreadPoolDestroy(global.updatePool);
+		global.updatePool = NULL;
+	}
+
+	if (threadCount > 1)
+	{
+		global.updatePool = _ThreadPoolCreate(threadCount);
+	}
+}
+
+// Paint the window's update region into its bits, split into tiles on the paint pool if allowed
+void _WindowPaint(Window *window, Painter *painter, bool allowTiles)
+{
+	uint64_t start = _TimeNow();
+
+	if (!allowTiles || !_PaintTiled(window))
+	{
+		// Paint everything in each rectangle of the update region separately,
+		// so the pixels between them are left alone
+		for (int j = 0; j < window->updateRegion.count; j++)
+		{
+			_PaintRectangle(window, painter, window->updateRegion.rectangles[j]);
+		}
+
+		window->pixelsPainted += painter->pixelsPainted;
+		window->paintsCulled += painter->paintsCulled;
+		window->paintVisits += painter->elementsVisited;
+		if (painter->depthMax > window->paintDepthMax) window->paintDepthMax = painter->depthMax;
+	}
+
+	window->pixelsUpdated += RegionArea(&window->updateRegion);
+	window->paintTime = _TimeNow() - start;
+	window->paintTimeTotal += window->paintTime;
+}
+
+// Tell the platform layer to put the result onto the screen, and clear the update region
+void _WindowPresentUpdate(Window *window, Painter *painter)
+{
+	uint64_t start = _TimeNow();
+
+	// Pixels ElementScroll moved are already right in the bits, but not on the screen yet.
+	// Everything in bits is up to date by now, so presenting a bit more where rectangles merge is harmless.
+	RegionClip(&window->presentRegion, RectangleMake(0, window->width, 0, window->height));
+
+	for (int i = 0; i < window->presentRegion.count; i++)
+	{
+		RegionAdd(&window->updateRegion, window->presentRegion.rectangles[i]);
+	}
+
+	window->presentRegion.count = 0;
+
+	{
+		TRACE_SCOPE("WindowEndPaint", window, NULL);
+		_WindowEndPaint(window, painter);
+	}
+
+	uint64_t end = _TimeNow();
+	window->presentTimeTotal += end - start;
+	window->frameTime = end - global.lastUpdateTime;
+
+	// Clear the update region, ready for the next input event cycle
+	window->updateRegion.count = 0;
+}
+
+void _WindowPaintTask(void *context, int index, int thread)
+{
+	(void) context;
+	(void) thread;
+
+	Window *window = global.updateWindows[index];
+	TRACE_SCOPE("WindowPaint", window, &window->pixelsPainted);
+	Painter painter = _WindowPainter(window);
+	_WindowPaint(window, &painter, false);
+
+	// Present it now rather than after the slowest window. The calling thread is running tasks
+	// until the job is done, so with the lock only one thread is in the platform layer at a time.
+	std::lock_guard<std::mutex> lock(global.presentMutex);
+	_WindowPresentUpdate(window, &painter);
+}
+
+// Paint the window's update region, if there is one, and present it
+void _WindowUpdate(Window *window)
+{
+	// Is there anything marked for repaint, or scrolled?
+	RegionClip(&window->updateRegion, RectangleMake(0, window->width, 0, window->height));
+
+	if (window->updateRegion.count || window->presentRegion.count)
+	{
+		// Give the platform layer a chance to wait until it's safe to write to the bits
+		_WindowBeginPaint(window);
+		Painter painter = _WindowPainter(window);
+		_WindowPaint(window, &painter, true);
+		_WindowPresentUpdate(window, &painter);
+	}
+}
+
+// Paint the windows that need it at the same time on the update pool, or on this thread if they can't be
+void _UpdateParallel()
+{
+	size_t updateWindowCount = 0;
+
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		Window *window = global.windows[i];
+		RegionClip(&window->updateRegion, RectangleMake(0, window->width, 0, window->height));
+		bool threadSafe = window->updateRegion.count != 0;
+
+		for (int j = 0; j < window->updateRegion.count && threadSafe; j++)
+		{
+			threadSafe = _ElementPaintThreadSafe(&window->e, window->updateRegion.rectangles[j]);
+		}
+
+		if (!threadSafe)
+		{
+			_WindowUpdate(window);
+			continue;
+		}
+
+		if (updateWindowCount == global.updateWindowCapacity)
+		{
+			global.updateWindowCapacity = global.updateWindowCapacity ? global.updateWindowCapacity * 2 : 8;
+			global.updateWindows = (Window **) realloc(global.updateWindows, sizeof(Window *) * global.updateWindowCapacity);
+		}
+
+		global.updateWindows[updateWindowCount++] = window;
+	}
+
+	if (updateWindowCount == 1)
+	{
+		// Nothing to paint alongside it, so it can use the tiles instead
+		_WindowUpdate(global.updateWindows[0]);
+	}
+	else if (updateWindowCount > 1)
+	{
+		// Waiting for the bits is done here, since it can read the platform's events
+		for (size_t i = 0; i < updateWindowCount; i++)
+		{
+			_WindowBeginPaint(global.updateWindows[i]);
+		}
+
+		_ThreadPoolRun(global.updatePool, (int) updateWindowCount, _WindowPaintTask, NULL);
+	}
+}
+
+void _Update()
+{
+	global.layerFrame++;
+	global.updateCount++;
+	global.lastUpdateTime = _TimeNow();
+	TRACE_SCOPE("Update", NULL, NULL);
+
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		Window *window = global.windows[i];
+		TRACE_SCOPE("WindowUpdate", window, &window->pixelsPainted);
+
+		// Lay out everything that was moved or asked for it since the last update,
+		// before painting, since layout usually causes repaints
+		uint64_t layoutStart = _TimeNow();
+		_WindowLayout(window);
+		window->layoutTimeTotal += _TimeNow() - layoutStart;
+
+		if (!global.updatePool)
+		{
+			_WindowUpdate(window);
+		}
+	}
+
+	if (global.updatePool)
+	{
+		// Only once every window is laid out, since layout can repaint other windows
+		_UpdateParallel();
+	}
+}
+
+// Invariant:  each element is responsible for the positioning of its children and nothing more.
+// Moves an element and triggers layout if needed
+void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout)
+{
+	// save the previous visible area to detect changes
+	Rectangle oldClip = element->clip;
+	// compute the new visible region:
+	//	- element's bounds
+	// 	- clipped by parent's visible area
+	// Enforces clipping automatically
+	element->clip = RectangleIntersection(element->parent->clip, bounds);
+
+	SpatialIndex *siblingIndex = element->parent->spatialIndex;
+
+	if (siblingIndex && !siblingIndex->dirty && !RectangleEquals(element->clip, oldClip))
+	{
+		// Update the parent's grid in place. The cells we're leaving tell us our index,
+		// unless we weren't visible before, in which case search for it.
+		int64_t index = _SpatialIndexRemove(element->parent, oldClip, element);
+		if (index == -1) index = _ElementIndex(element);
+		_SpatialIndexAdd(siblingIndex, element->clip, (uint32_t) index);
+	}
+
+	if (!RectangleEquals(element->clip, oldClip))
+	{
+		// Our own grid covers our clip, so it must be rebuilt
+		_SpatialIndexInvalidate(element);
+	}
+
+	if (!RectangleEquals(element->bounds, bounds) || !RectangleEquals(element->clip, oldClip))
+	{
+		// Inside a layer, nothing else would tell the cached bitmap that we moved.
+		// Start from the parent: if we have a layer ourselves, it's resized on its next paint.
+		_ElementDamageLayers(element->parent, oldClip);
+		_ElementDamageLayers(element->parent, element->clip);
+	}
+
+	// only re-layout if:
+	// 	- bounds changed, OR
+	// 	- visible region changed, OR
+	// 	- caller forces it (alwaysLayout)
+	// to prevent unnecessary layout propagration
+	if (!RectangleEquals(element->bounds, bounds)
+					|| !RectangleEquals(element->clip, oldClip)
+					|| alwaysLayout)
+	{
+		// commit new bounds
+		element->bounds = bounds;
+		_ElementInvalidateDisplayList(element);
+		// notify the element: "Your bounds/clip changed; reposition your children".
+		// This is deferred to the layout pass in _Update, so if the element is moved
+		// several times before then it is only laid out once.
+		ElementRelayout(element);
+	}
+
+	_ElementSync(element);
+}
+
+// Mark the path up to the window, so the layout pass can skip clean subtrees.
+// Stop at the first ancestor that's already marked; the rest of the path is too.
+void _ElementMarkLayoutPath(Element *element)
+{
+	for (Element *ancestor = element->parent; ancestor; ancestor = ancestor->parent)
+	{
+		if (ancestor->flags & ELEMENT_LAYOUT_DESCENDANT_DIRTY) break;
+		ancestor->flags |= ELEMENT_LAYOUT_DESCENDANT_DIRTY;
+		_ElementSyncFlags(ancestor);
+	}
+}
+
+void ElementRelayout(Element *element)
+{
+	if (element->flags & ELEMENT_LAYOUT_DIRTY)
+	{
+		element->window->layoutSkippedCount++;
+		return;
+	}
+
+	element->flags |= ELEMENT_LAYOUT_DIRTY;
+	_ElementSyncFlags(element);
+	_ElementMarkLayoutPath(element);
+}
+
+// Top-down: an element is laid out before its children, so the ElementMove calls
+// in its MSG_LAYOUT handler mark exactly the children that we visit next.
+// The path down to the element being visited is kept on the window's layout stack rather than
+// in recursion, and each level remembers the next child to check. A child's flags are only
+// read when the pass gets to it, since laying out one child can mark a later sibling.
+void _ElementLayout(Element *element)
+{
+	Window *window = element->window;
+	uint32_t depth = 0;
+
+	while (element)
+	{
+		window->layoutVisits++;
+		if (depth > window->layoutDepthMax) window->layoutDepthMax = depth;
+
+		if (element->flags & ELEMENT_LAYOUT_DIRTY)
+		{
+			element->flags &= ~ELEMENT_LAYOUT_DIRTY;
+			_ElementSyncFlags(element);
+			window->layoutCount++;
+			ElementMessage(element, MSG_LAYOUT, 0, 0);
+		}
+
+		if (element->flags & ELEMENT_LAYOUT_DESCENDANT_DIRTY)
+		{
+			// Cleared before visiting the children, so if a handler marks something
+			// we've already passed, the path gets marked again
+			element->flags &= ~ELEMENT_LAYOUT_DESCENDANT_DIRTY;
+			_ElementSyncFlags(element);
+
+			if (depth == window->layoutStackCapacity)
+			{
+				window->layoutStackCapacity = window->layoutStackCapacity ? window->layoutStackCapacity * 2 : 16;
+				window->layoutStack = (LayoutFrame *) realloc(window->layoutStack, sizeof(LayoutFrame) * window->layoutStackCapacity);
+			}
+
+			window->layoutStack[depth++] = { element, 0 };
+		}
+
+		element = NULL;
+
+		// Find the next dirty child in the store, without touching the clean ones,
+		// going back up a level whenever one runs out
+		while (depth && !element)
+		{
+			LayoutFrame *frame = &window->layoutStack[depth - 1];
+			Element *parent = frame->element;
+			uint32_t *flags = window->store.flags;
+			const uint32_t dirty = ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDANT_DIRTY;
+
+			while (frame->next < parent->childCount && !(flags[parent->childHandles[frame->next]] & dirty))
+			{
+				frame->next++;
+			}
+
+			if (frame->next >= parent->childCount)
+			{
+				depth--;
+				continue;
+			}
+
+			element = parent->children[frame->next++];
+
+			if (frame->next < parent->childCount && (flags[parent->childHandles[frame->next]] & dirty))
+			{
+				_Prefetch(parent->children[frame->next]);
+			}
+		}
+	}
+}
+
+void _WindowLayout(Window *window)
+{
+	// Handlers can ask for layout of elements the pass has already visited (e.g. a parent),
+	// so go again until nothing is dirty. Give up eventually rather than loop forever
+	// on handlers that keep invalidating each other.
+	for (int pass = 0; pass < 16 && (window->e.flags & (ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDANT_DIRTY)); pass++)
+	{
+		_ElementLayout(&window->e);
+	}
+}
+
+void ElementRepaint(Element *element, Rectangle *region)
+{
+	if (!region)
+	{
+		// If the region to repaint was not specified, use the whole bounds of the element
+		region = &element->bounds;
+	}
+
+	// What the element painted last time is out of date
+	_ElementInvalidateDisplayList(element);
+
+	// Intersect the region to repaint with the element's clip
+	Rectangle r = RectangleIntersection(*region, element->clip);
+
+	// if the intersection is non-empty...
+	if (RectangleValid(r))
+	{
+		// Add it to the window's update region. Rectangles far apart from each
+		// other are kept separate, so only the pixels that changed are repainted.
+		RegionAdd(&element->window->updateRegion, r);
+
+		// Layers containing the element have to repaint that part of their bitmap too
+		_ElementDamageLayers(element, r);
+	}
+}
+
+// Move the pixels of bits inside clip by (dx, dy). bits is addressed in window coordinates,
+// stride pixels per row. damage is the surface's region waiting to be repainted: the parts of
+// it inside clip move with the pixels, and the strips uncovered by the move are added to it.
+// Returns the number of pixels moved.
+int64_t _SurfaceScroll(uint32_t *bits, int stride, Region *damage, Rectangle clip, int dx, int dy)
+{
+	Rectangle destination = RectangleIntersection(clip, RectangleTranslate(clip, dx, dy));
+
+	if (!RectangleValid(destination))
+	{
+		// Scrolled by more than the clip, so nothing can be reused
+		RegionAdd(damage, clip);
+		return 0;
+	}
+
+	int bytes = (destination.r - destination.l) * 4;
+
+	// Go through the rows in the opposite direction to the move, so no row is overwritten
+	// before it's copied; within a row, memmove handles the overlap
+	if (dy > 0)
+	{
+		for (int y = destination.b - 1; y >= destination.t; y--)
+		{
+			memmove(&bits[(ptrdiff_t) y * stride + destination.l], &bits[(ptrdiff_t) (y - dy) * stride + destination.l - dx], bytes);
+		}
+	}
+	else
+	{
+		for (int y = destination.t; y < destination.b; y++)
+		{
+			memmove(&bits[(ptrdiff_t) y * stride + destination.l], &bits[(ptrdiff_t) (y - dy) * stride + destination.l - dx], bytes);
+		}
+	}
+
+	// Pixels that were waiting to be repainted have moved; they're still wrong where they were too
+	Region pending = *damage;
+
+	for (int i = 0; i < pending.count; i++)
+	{
+		Rectangle r = RectangleIntersection(pending.rectangles[i], clip);
+		if (RectangleValid(r)) RegionAdd(damage, RectangleIntersection(RectangleTranslate(r, dx, dy), clip));
+	}
+
+	// The strips that scrolled into view
+	if (dy > 0) RegionAdd(damage, RectangleMake(clip.l, clip.r, clip.t, destination.t));
+	if (dy < 0) RegionAdd(damage, RectangleMake(clip.l, clip.r, destination.b, clip.b));
+	if (dx > 0) RegionAdd(damage, RectangleMake(clip.l, destination.l, clip.t, clip.b));
+	if (dx < 0) RegionAdd(damage, RectangleMake(destination.r, clip.r, clip.t, clip.b));
+
+	return _RectangleArea(destination);
+}
+
+// Move the subtree by (dx, dy), keeping the clips up to date. Nothing inside it changes relative
+// to anything else, so there's no layout, and caches stay valid where the element stays fully visible.
+void _ElementTranslate(Element *element, int dx, int dy)
+{
+	Rectangle oldClip = element->clip;
+	element->bounds = RectangleTranslate(element->bounds, dx, dy);
+	element->clip = RectangleIntersection(element->parent->clip, element->bounds);
+	_ElementSync(element);
+	_ElementInvalidateDisplayList(element);
+
+	if (element->layer && element->layer->bits && RectangleEquals(element->clip, RectangleTranslate(oldClip, dx, dy)))
+	{
+		// The bitmap's contents are the same, just somewhere else
+		Layer *layer = element->layer;
+		layer->bounds = element->clip;
+
+		for (int i = 0; i < layer->dirty.count; i++)
+		{
+			layer->dirty.rectangles[i] = RectangleTranslate(layer->dirty.rectangles[i], dx, dy);
+		}
+	}
+
+	// The grid covers the clip, and the children's clips have all moved
+	_SpatialIndexInvalidate(element);
+
+	for (uintptr_t i = 0; i < element->childCount; i++)
+	{
+		_ElementTranslate(element->children[i], dx, dy);
+	}
+}
+
+void ElementScroll(Element *element, int dx, int dy)
+{
+	if (!dx && !dy) return;
+
+	// The pixels move the opposite way to the view
+	int moveX = -dx, moveY = -dy;
+	Rectangle clip = element->clip;
+	Window *window = element->window;
+
+	if (RectangleValid(clip))
+	{
+		// Wait until the platform layer has finished with the bits, as if we were about to paint
+		_WindowBeginPaint(window);
+		window->pixelsScrolled += _SurfaceScroll(window->bits, window->stride, &window->updateRegion, clip, moveX, moveY);
+
+		// The moved pixels aren't repainted, but the screen still needs them
+		Rectangle destination = RectangleIntersection(clip, RectangleTranslate(clip, moveX, moveY));
+		if (RectangleValid(destination)) RegionAdd(&window->presentRegion, destination);
+
+		// The layers containing the element hold the same pixels, so move them there too
+		for (Element *ancestor = element; global.layerCount && ancestor; ancestor = ancestor->parent)
+		{
+			Layer *layer = ancestor->layer;
+			if (!layer || !layer->bits) continue;
+
+			if (!RectangleEquals(layer->bounds, ancestor->clip))
+			{
+				// It's going to be reallocated and repainted anyway
+				continue;
+			}
+
+			uint32_t *bits = layer->bits - ((ptrdiff_t) layer->bounds.t * (layer->bounds.r - layer->bounds.l) + layer->bounds.l);
+			_SurfaceScroll(bits, layer->bounds.r - layer->bounds.l, &layer->dirty, clip, moveX, moveY);
+		}
+
+		// Anything painted over the element that isn't part of it was moved with it by mistake.
+		// That's the later siblings of the element and of each of its ancestors.
+		Rectangle *clips = window->store.clips;
+
+		for (Element *child = element; child->parent; child = child->parent)
+		{
+			Element *parent = child->parent;
+
+			for (uint32_t i = _ElementIndex(child) + 1; i < parent->childCount; i++)
+			{
+				Rectangle r = RectangleIntersection(clips[parent->childHandles[i]], clip);
+				if (!RectangleValid(r)) continue;
+
+				// Repaint where it is, and where its pixels were moved to
+				Rectangle moved = RectangleIntersection(RectangleTranslate(r, moveX, moveY), clip);
+				RegionAdd(&window->updateRegion, r);
+				RegionAdd(&window->updateRegion, moved);
+				_ElementDamageLayers(parent, r);
+				_ElementDamageLayers(parent, moved);
+			}
+		}
+	}
+
+	for (uintptr_t i = 0; i < element->childCount; i++)
+	{
+		_ElementTranslate(element->children[i], moveX, moveY);
+	}
+
+	_SpatialIndexInvalidate(element);
+}
+
+// Two-layer message dispatch with user override and class falback
+// Dispatch a messeage to an element
+// User handler is given first refusal:
+// 	- non-zero return means "handled" -> stop dispatch
+// 	- zero return means "not handled" -> fall through
+// If the user handler declines, the class (default) handler runs
+// The return value indicates whether the message was untlimately handled
+int ElementMessage(Element *element, Message message, int di, void *dp)
+{
+	TRACE_SCOPE(_TraceMessageName(message), element, message == MSG_PAINT ? &((Painter *) dp)->pixelsPainted : NULL);
+
+	if (element->messageUser)
+	{
+		int result = element->messageUser(element, message, di, dp);
+
+		if (result)
+		{
+			return result;
+		}
+		else
+		{
+			// keep going!
+		}
+	}
+
+	if (element->messageClass)
+	{
+		return element->messageClass(element, message, di, dp);
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+// axis 0 is the width (constrained by the height), 1 the height (constrained by the width)
+int _ElementMeasure(Element *element, int axis, int constraint)
+{
+	uint32_t cached = axis ? ELEMENT_HEIGHT_CACHED : ELEMENT_WIDTH_CACHED;
+
+	if ((element->flags & cached) && element->measuredFor[axis] == constraint)
+	{
+		return element->measuredSize[axis];
+	}
+
+	element->window->measureCount++;
+	element->measuredSize[axis] = ElementMessage(element, axis ? MSG_GET_HEIGHT : MSG_GET_WIDTH, constraint, 0);
+	element->measuredFor[axis] = constraint;
+
+	if (!(element->flags & cached))
+	{
+		element->flags |= cached;
+		_ElementSyncFlags(element);
+	}
+
+	return element->measuredSize[axis];
+}
+
+int ElementGetWidth(Element *element, int height)
+{
+	return _ElementMeasure(element, 0, height);
+}
+
+int ElementGetHeight(Element *element, int width)
+{
+	return _ElementMeasure(element, 1, width);
+}
+
+// Containers measure themselves from their children, so forget the sizes up the path too.
+// Stop at the first element with nothing cached: nobody has measured it since it last changed,
+// so nothing above it can have been measured from it.
+void _ElementForgetSizes(Element *element)
+{
+	const uint32_t cached = ELEMENT_WIDTH_CACHED | ELEMENT_HEIGHT_CACHED;
+
+	for (Element *ancestor = element; ancestor && (ancestor->flags & cached); ancestor = ancestor->parent)
+	{
+		ancestor->flags &= ~cached;
+		_ElementSyncFlags(ancestor);
+
+		if (ancestor->parent)
+		{
+			// The parent placed it using the old size
+			ElementRelayout(ancestor->parent);
+		}
+	}
+}
+
+void ElementRemeasure(Element *element)
+{
+	// Whatever changed may move its children too (e.g. a box's padding), even if nobody has measured it
+	ElementRelayout(element);
+	_ElementForgetSizes(element);
+}
+
+
+// Insert element into parent->children at index. The array grows geometrically,
+// so appending N children costs O(N) copies in total rather than O(N^2).
+void _ElementAttach(Element *element, Element *parent, uint32_t index)
+{
+	if (parent->childCount == parent->childCapacity)
+	{
+		parent->childCapacity = parent->childCapacity ? parent->childCapacity * 2 : 4;
+		parent->children = (Element **) realloc(parent->children, sizeof(Element *) * parent->childCapacity);
+		parent->childHandles = (ElementHandle *) realloc(parent->childHandles, sizeof(ElementHandle) * parent->childCapacity);
+	}
+
+	memmove(&parent->children[index + 1], &parent->children[index], sizeof(Element *) * (parent->childCount - index));
+	memmove(&parent->childHandles[index + 1], &parent->childHandles[index], sizeof(ElementHandle) * (parent->childCount - index));
+	parent->children[index] = element;
+	parent->childHandles[index] = element->handle;
+	parent->childCount++;
+	element->parent = parent;
+	_ElementSync(element);
+
+	if (index != parent->childCount - 1)
+	{
+		// The indices of the children after it have changed
+		_SpatialIndexInvalidate(parent);
+	}
+	else if (parent->spatialIndex && !parent->spatialIndex->dirty)
+	{
+		_SpatialIndexAdd(parent->spatialIndex, element->clip, index);
+	}
+}
+
+uint32_t _ElementIndex(Element *element)
+{
+	Element *parent = element->parent;
+
+	// Search from the back, since recently added children are the most likely to be changed
+	for (uint32_t i = parent->childCount; i > 0; i--)
+	{
+		if (parent->children[i - 1] == element)
+		{
+			return i - 1;
+		}
+	}
+
+	return parent->childCount;
+}
+
+void ElementInsert(Element *element, Element *parent, uint32_t index)
+{
+	if (index > parent->childCount) index = parent->childCount;
+	_ElementAttach(element, parent, index);
+
+	if (element->flags & (ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDANT_DIRTY))
+	{
+		// It was waiting for layout when it was removed; the new path to it needs marking
+		_ElementMarkLayoutPath(element);
+	}
+
+	ElementRepaint(element, NULL);
+	ElementRelayout(parent);
+	_ElementForgetSizes(parent);
+}
+
+void ElementRemove(Element *element)
+{
+	Element *parent = element->parent;
+	if (!parent) return;
+
+	// Repaint where it was, while it's still attached (so layers it's inside hear about it)
+	ElementRepaint(element, NULL);
+
+	uint32_t index = _ElementIndex(element);
+	memmove(&parent->children[index], &parent->children[index + 1], sizeof(Element *) * (parent->childCount - index - 1));
+	memmove(&parent->childHandles[index], &parent->childHandles[index + 1], sizeof(ElementHandle) * (parent->childCount - index - 1));
+	parent->childCount--;
+	element->parent = NULL;
+	_ElementSync(element);
+	_SpatialIndexInvalidate(parent);
+	ElementRelayout(parent);
+	_ElementForgetSizes(parent);
+}
+
+void ElementReorder(Element *element, uint32_t index)
+{
+	Element *parent = element->parent;
+	if (!parent) return;
+	if (index >= parent->childCount) index = parent->childCount - 1;
+
+	uint32_t from = _ElementIndex(element);
+
+	// Shift the children in between by one place, towards where the element was
+	if (from < index)
+	{
+		memmove(&parent->children[from], &parent->children[from + 1], sizeof(Element *) * (index - from));
+		memmove(&parent->childHandles[from], &parent->childHandles[from + 1], sizeof(ElementHandle) * (index - from));
+	}
+	else
+	{
+		memmove(&parent->children[index + 1], &parent->children[index], sizeof(Element *) * (from - index));
+		memmove(&parent->childHandles[index + 1], &parent->childHandles[index], sizeof(ElementHandle) * (from - index));
+	}
+
+	parent->children[index] = element;
+	parent->childHandles[index] = element->handle;
+	_SpatialIndexInvalidate(parent);
+	ElementRepaint(element, NULL);
+	ElementRelayout(parent);
+	_ElementForgetSizes(parent);
+}
+
+Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass)
+{
+	// Elements are carved from their window's arena. The window element itself
+	// (no parent) holds the arena, so it has to come from the heap.
+	Element *element = (Element *) (parent ? ArenaAllocate(&parent->window->arena, bytes) : calloc(1, bytes));
+	element->flags = flags;
+	element->messageClass = messageClass;
+
+	// An element without a parent is the window element, which is the start of its Window
+	element->window = parent ? parent->window : (Window *) element;
+	_ElementStoreAdd(element);
+	if (flags & ELEMENT_OPAQUE) element->window->opaqueCount++;
+
+	if (parent)		// element is not the root
+	{
+		_ElementAttach(element, parent, parent->childCount);
+		_ElementForgetSizes(parent);
+	}
+	return element;
+}
+
+Element *ElementFindByPoint(Window *window, int x, int y)
+{
+	Element *element = &window->e;
+
+	if (!RectangleContains(element->clip, x, y))
+	{
+		return NULL;
+	}
+
+	// Descend into the topmost (last painted) child containing the point, until there isn't one
+	while (true)
+	{
+		Element *hit = NULL;
+
+		if (element->flags & ELEMENT_SPATIAL_INDEX)
+		{
+			uint32_t count;
+			uint32_t *indices = _SpatialIndexQuery(element, RectangleMake(x, x + 1, y, y + 1), &count);
+			if (count) hit = element->children[indices[count - 1]];
+			free(indices);
+		}
+		else
+		{
+			Rectangle *clips = window->store.clips;
+
+			for (uint32_t i = element->childCount; i > 0 && !hit; i--)
+			{
+				if (RectangleContains(clips[element->childHandles[i - 1]], x, y))
+				{
+					hit = element->children[i - 1];
+				}
+			}
+		}
+
+		if (!hit)
+		{
+			return element;
+		}
+
+		element = hit;
+	}
+}
+
+// Send MSG_DESTROY to the subtree and free the children arrays, children first.
+// With freeElements the elements go back to the arena one by one; without it the
+// caller is about to release the whole arena anyway.
+void _ElementDestroyTree(Element *element, bool freeElements)
+{
+	for (uintptr_t i = 0; i < element->childCount; i++)
+	{
+		_ElementDestroyTree(element->children[i], freeElements);
+	}
+
+	ElementMessage(element, MSG_DESTROY, 0, 0);
+	if (element->flags & ELEMENT_OPAQUE) element->window->opaqueCount--;
+	free(element->children);
+	free(element->childHandles);
+	_SpatialIndexFree(element->spatialIndex);
+
+	if (element->displayList)
+	{
+		free(element->displayList->data);
+		free(element->displayList);
+	}
+
+	_LayerDestroy(element);
+
+	if (global.timerCount)
+	{
+		_TimersRemoveElement(element);
+	}
+
+	if (freeElements && element != &element->window->e)
+	{
+		_ElementStoreRemove(element);
+		ArenaFree(&element->window->arena, element);
+	}
+}
+
+void ElementDestroy(Element *element)
+{
+	ElementRemove(element);
+	_ElementDestroyTree(element, true);
+}
+
+// Shared part of WindowDestroy: tear down the element tree, release the arena in one go
+// and forget the window. The backend frees its own resources first.
+void _WindowDestroyElements(Window *window)
+{
+	_ElementDestroyTree(&window->e, false);
+	ArenaRelease(&window->arena);
+	_ElementStoreFree(&window->store);
+	free(window->paintStack.entries);
+	free(window->layoutStack);
+
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		if (global.windows[i] == window)
+		{
+			global.windows[i] = global.windows[--global.windowCount];
+			break;
+		}
+	}
+
+	free(window);
+}
+
+
+////////////////////////////////////
+//- Timers and frame pacing
+
+uint64_t _TimeNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint32_t TimerCreate(Element *element, int intervalMs, bool repeat)
+{
+	if (global.timerCount == global.timerCapacity)
+	{
+		global.timerCapacity = global.timerCapacity ? global.timerCapacity * 2 : 8;
+		global.timers = (Timer *) realloc(global.timers, sizeof(Timer) * global.timerCapacity);
+	}
+
+	// At least a millisecond, so a repeating timer can't fire again in the same pass
+	if (intervalMs < 1) intervalMs = 1;
+
+	Timer *timer = &global.timers[global.timerCount++];
+	timer->element = element;
+	timer->interval = (uint64_t) intervalMs * 1000000;
+	timer->deadline = _TimeNow() + timer->interval;
+	if (!++global.timerLastID) global.timerLastID++;	// 0 is never a valid id, even after wrapping around
+	timer->id = global.timerLastID;
+	timer->repeat = repeat;
+	return timer->id;
+}
+
+void TimerDestroy(uint32_t id)
+{
+	for (uintptr_t i = 0; i < global.timerCount; i++)
+	{
+		if (global.timers[i].id == id)
+		{
+			global.timers[i] = global.timers[--global.timerCount];
+			return;
+		}
+	}
+}
+
+// Called as the element is destroyed
+void _TimersRemoveElement(Element *element)
+{
+	for (uintptr_t i = 0; i < global.timerCount; i++)
+	{
+		if (global.timers[i].element == element)
+		{
+			global.timers[i--] = global.timers[--global.timerCount];
+		}
+	}
+}
+
+// Send MSG_TIMER for every timer whose deadline has passed
+void _TimersFire(uint64_t now)
+{
+	bool fired = true;
+
+	// The handlers can create and destroy timers, so start again after each one.
+	// Timers that have fired are rescheduled after now, so this finishes.
+	while (fired)
+	{
+		fired = false;
+
+		for (uintptr_t i = 0; i < global.timerCount; i++)
+		{
+			Timer timer = global.timers[i];
+			if (timer.deadline > now) continue;
+
+			if (timer.repeat)
+			{
+				// If we fell behind, skip the missed ticks rather than firing them all at once
+				global.timers[i].deadline = timer.deadline + timer.interval > now ? timer.deadline + timer.interval : now + timer.interval;
+			}
+			else
+			{
+				global.timers[i] = global.timers[--global.timerCount];
+			}
+
+			ElementMessage(timer.element, MSG_TIMER, timer.id, NULL);
+			fired = true;
+			break;
+		}
+	}
+}
+
+void MessageLoopPost(Element *element, Message message, int di, void *dp)
+{
+	{
+		std::lock_guard<std::mutex> lock(global.postedMutex);
+
+		if (global.postedCount == global.postedCapacity)
+		{
+			global.postedCapacity = global.postedCapacity ? global.postedCapacity * 2 : 16;
+			global.posted = (PostedMessage *) realloc(global.posted, sizeof(PostedMessage) * global.postedCapacity);
+		}
+
+		global.posted[global.postedCount++] = { element, message, di, dp };
+	}
+
+#if OS_LINUX
+	uint64_t one = 1;
+	if (write(global.wakeFD, &one, sizeof(one))) {}
+#elif OS_WINDOWS
+	SetEvent(global.wakeEvent);
+#endif
+}
+
+bool _MessageLoopHasPosted()
+{
+	std::lock_guard<std::mutex> lock(global.postedMutex);
+	return global.postedCount != 0;
+}
+
+void _MessageLoopDeliverPosted()
+{
+	// Take the whole queue, so messages posted by the handlers wait for the next pass
+	PostedMessage *posted;
+	size_t postedCount;
+
+	{
+		std::lock_guard<std::mutex> lock(global.postedMutex);
+		posted = global.posted;
+		postedCount = global.postedCount;
+		global.posted = NULL;
+		global.postedCount = global.postedCapacity = 0;
+	}
+
+	for (uintptr_t i = 0; i < postedCount; i++)
+	{
+		ElementMessage(posted[i].element, posted[i].message, posted[i].di, posted[i].dp);
+	}
+
+	free(posted);
+}
+
+void MessageLoopSetFrameRate(int framesPerSecond)
+{
+	global.frameInterval = framesPerSecond > 0 ? 1000000000 / framesPerSecond : 0;
+}
+
+// Is there anything for _Update to do?
+bool _UpdatePending()
+{
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		Window *window = global.windows[i];
+
+		if (window->updateRegion.count || window->presentRegion.count
+				|| (window->e.flags & (ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDANT_DIRTY)))
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// The shared part of each pass of the message loop, after the platform's events are handled:
+// deliver posted messages and due timers, then update if there's anything to do and the frame
+// rate allows it. Returns the _TimeNow() value at which the loop next has something to do,
+// or UINT64_MAX if only an event or MessageLoopPost can give it something.
+uint64_t _MessageLoopTick()
+{
+	_MessageLoopDeliverPosted();
+	uint64_t now = _TimeNow();
+	_TimersFire(now);
+
+	uint64_t deadline = UINT64_MAX;
+
+	if (_UpdatePending())
+	{
+		uint64_t nextFrame = global.lastUpdateTime + global.frameInterval;
+
+		if (now >= nextFrame)
+		{
+			_Update();
+		}
+		else
+		{
+			deadline = nextFrame;
+		}
+	}
+
+	for (uintptr_t i = 0; i < global.timerCount; i++)
+	{
+		if (global.timers[i].deadline < deadline)
+		{
+			deadline = global.timers[i].deadline;
+		}
+	}
+
+	return deadline;
+}
+
+////////////////////////////////////
+//- Helpers
+Rectangle RectangleMake(int l, int r, int t, int b)
+{
+	return Rectangle{l, r, t, b};
+}
+
+// valid if width and height are positive
+bool RectangleValid(Rectangle a)
+{
+	bool valid = true;
+
+	if ((a.r - a.l) < 0) valid = false;
+	if ((a.b - a.t) < 0) valid = false;
+
+	return valid;
+}
+
+// Compute the intersection of the rectangles, i.e. the biggest rectangle that fits 
+// into both. If the rectangles don't overlap, an invalid rectangle is returned 
+// (as per RectangleValid).
+Rectangle RectangleIntersection(Rectangle a, Rectangle b)
+{
+	// where do both rectangles exist at the same time, an AND operation
+	if (a.l < b.l) a.l = b.l;
+	if (a.t < b.t) a.t = b.t;
+	if (a.r > b.r) a.r = b.r;
+	if (a.b > b.b) a.b = b.b;
+
+	return a;
+}
+
+// Compute the smallest rectangle containing both of the input rectangles.
+Rectangle RectangleBounding(Rectangle a, Rectangle b)
+{
+	// what is the minimum rectangle that encloses both, an OR operation
+	if (a.l > b.l) a.l = b.l;
+	if (a.t > b.t) a.t = b.t;
+	if (a.r < b.r) a.r = b.r;
+	if (a.b < b.b) a.b = b.b;
+
+	return a; 
+}
+
+Rectangle RectangleTranslate(Rectangle a, int dx, int dy)
+{
+	a.l += dx;
+	a.r += dx;
+	a.t += dy;
+	a.b += dy;
+	return a;
+}
+
+// Returns true if all sides are equal.
+bool RectangleEquals(Rectangle a, Rectangle b)
+{
+	bool equal = false;
+	if (a.l == b.l && a.t == b.t && a.r == b.r && a.b == b.b)
+		equal = true;
+
+	return equal;
+}
+
+// Returns true if the pixel with its top-left at the given coordinate is contained 
+// inside the rectangle.
+bool RectangleContains(Rectangle a, int x, int y)
+{
+	// (x, y) gives the top-left corner of the pixel. (treating pixel as 1x1 pixel square/rectangle: l,r,t,b [x, x), [y, y) )
+	// x ∈ [a.l, a.r)
+	// y ∈ [a.t, a.b)
+
+	// Therefore we use strict inequalities when comparing against the right 
+	// and bottom sides of the rectangle.
+	return a.l <= x && a.r > x && a.t <= y && a.b > y;
+}
+
+int64_t _RectangleArea(Rectangle a)
+{
+	if (a.r <= a.l || a.b <= a.t) return 0;
+	return (int64_t) (a.r - a.l) * (a.b - a.t);
+}
+
+// Extra pixels the bounding rectangle of a and b covers, compared to a and b themselves
+int64_t _RectangleMergeWaste(Rectangle a, Rectangle b)
+{
+	int64_t covered = _RectangleArea(a) + _RectangleArea(b) - _RectangleArea(RectangleIntersection(a, b));
+	return _RectangleArea(RectangleBounding(a, b)) - covered;
+}
+
+void RegionAdd(Region *region, Rectangle r)
+{
+	if (!_RectangleArea(r)) return;
+
+	// Each time r is merged with one of the rectangles, that rectangle is removed and
+	// the bigger r has to be checked against the others again. The count goes down
+	// by one every time, so this terminates.
+	while (true)
+	{
+		int merge = -1;
+
+		for (int i = 0; i < region->count; i++)
+		{
+			Rectangle existing = region->rectangles[i];
+
+			// Overlapping rectangles are always merged to keep the region disjoint;
+			// others only if the bounding rectangle is at most 25% bigger than both.
+			bool overlaps = _RectangleArea(RectangleIntersection(existing, r)) > 0;
+			int64_t waste = _RectangleMergeWaste(existing, r);
+
+			if (overlaps || waste * 4 <= _RectangleArea(existing) + _RectangleArea(r))
+			{
+				merge = i;
+				break;
+			}
+		}
+
+		if (merge == -1 && region->count < REGION_MAX_RECTANGLES)
+		{
+			region->rectangles[region->count++] = r;
+			return;
+		}
+
+		if (merge == -1)
+		{
+			// The region is full, so merge with whichever rectangle wastes the least
+			int64_t leastWaste = INT64_MAX;
+
+			for (int i = 0; i < region->count; i++)
+			{
+				int64_t waste = _RectangleMergeWaste(region->rectangles[i], r);
+
+				if (waste < leastWaste)
+				{
+					leastWaste = waste;
+					merge = i;
+				}
+			}
+		}
+
+		r = RectangleBounding(region->rectangles[merge], r);
+		region->rectangles[merge] = region->rectangles[--region->count];
+	}
+}
+
+void RegionClip(Region *region, Rectangle clip)
+{
+	for (int i = 0; i < region->count; i++)
+	{
+		region->rectangles[i] = RectangleIntersection(region->rectangles[i], clip);
+
+		if (!_RectangleArea(region->rectangles[i]))
+		{
+			region->rectangles[i--] = region->rectangles[--region->count];
+		}
+	}
+}
+
+int64_t RegionArea(Region *region)
+{
+	// The rectangles are disjoint, so their areas can just be summed
+	int64_t area = 0;
+
+	for (int i = 0; i < region->count; i++)
+	{
+		area += _RectangleArea(region->rectangles[i]);
+	}
+
+	return area;
+}
+
+void StringCopy(char **destination, size_t *destinationBytes, const char *source, ptrdiff_t sourceBytes)
+{
+	if (sourceBytes == -1) sourceBytes = strlen(source);
+	*destination = (char *) realloc(*destination, sourceBytes);
+	*destinationBytes = sourceBytes;
+	memcpy(*destination, source, sourceBytes);
+}
+
+////////////////////////////////////
+//- Painting
+
+// Blocks at least this many bytes big are filled with non-temporal stores. They're too
+// big to stay in cache anyway, so writing around it avoids evicting everything else
+// (and skips reading the destination lines in first).
+#define DRAW_STREAM_BYTES (1 << 20)
+
+#if COMPILER_MSVC
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#endif
+
+void _FillRowScalar(uint32_t *row, int count, uint32_t colour, bool stream)
+{
+	(void) stream;
+
+	for (int i = 0; i < count; i++)
+	{
+		row[i] = colour;
+	}
+}
+
+#if ARCH_X64
+
+// SSE2 is part of x64, so no target attribute is needed.
+void _FillRowSSE2(uint32_t *row, int count, uint32_t colour, bool stream)
+{
+	// Scalar head until the row is 16 byte aligned (at most 3 pixels)
+	while (count > 0 && ((uintptr_t) row & 15))
+	{
+		*row++ = colour;
+		count--;
+	}
+
+	__m128i v = _mm_set1_epi32((int) colour);
+
+	if (stream)
+	{
+		for (; count >= 16; count -= 16, row += 16)
+		{
+			_mm_stream_si128((__m128i *) (row + 0), v);
+			_mm_stream_si128((__m128i *) (row + 4), v);
+			_mm_stream_si128((__m128i *) (row + 8), v);
+			_mm_stream_si128((__m128i *) (row + 12), v);
+		}
+	}
+	else
+	{
+		for (; count >= 16; count -= 16, row += 16)
+		{
+			_mm_store_si128((__m128i *) (row + 0), v);
+			_mm_store_si128((__m128i *) (row + 4), v);
+			_mm_store_si128((__m128i *) (row + 8), v);
+			_mm_store_si128((__m128i *) (row + 12), v);
+		}
+	}
+
+	for (; count >= 4; count -= 4, row += 4)
+	{
+		_mm_store_si128((__m128i *) row, v);
+	}
+
+	// Scalar tail (at most 3 pixels)
+	while (count > 0)
+	{
+		*row++ = colour;
+		count--;
+	}
+}
+
+TARGET_AVX2 void _FillRowAVX2(uint32_t *row, int count, uint32_t colour, bool stream)
+{
+	__m256i v = _mm256_set1_epi32((int) colour);
+	__m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+	// Masked head up to the next 32 byte boundary
+	int head = (int) ((32 - ((uintptr_t) row & 31)) & 31) / 4;
+	if (head > count) head = count;
+
+	if (head)
+	{
+		_mm256_maskstore_epi32((int *) row, _mm256_cmpgt_epi32(_mm256_set1_epi32(head), lanes), v);
+		row += head, count -= head;
+	}
+
+	if (stream)
+	{
+		for (; count >= 32; count -= 32, row += 32)
+		{
+			_mm256_stream_si256((__m256i *) (row + 0), v);
+			_mm256_stream_si256((__m256i *) (row + 8), v);
+			_mm256_stream_si256((__m256i *) (row + 16), v);
+			_mm256_stream_si256((__m256i *) (row + 24), v);
+		}
+	}
+	else
+	{
+		for (; count >= 32; count -= 32, row += 32)
+		{
+			_mm256_store_si256((__m256i *) (row + 0), v);
+			_mm256_store_si256((__m256i *) (row + 8), v);
+			_mm256_store_si256((__m256i *) (row + 16), v);
+			_mm256_store_si256((__m256i *) (row + 24), v);
+		}
+	}
+
+	for (; count >= 8; count -= 8, row += 8)
+	{
+		_mm256_store_si256((__m256i *) row, v);
+	}
+
+	// Masked tail
+	if (count > 0)
+	{
+		_mm256_maskstore_epi32((int *) row, _mm256_cmpgt_epi32(_mm256_set1_epi32(count), lanes), v);
+	}
+}
+
+TARGET_AVX512 void _FillRowAVX512(uint32_t *row, int count, uint32_t colour, bool stream)
+{
+	__m512i v = _mm512_set1_epi32((int) colour);
+
+	// Masked head up to the next 64 byte (cache line) boundary
+	int head = (int) ((64 - ((uintptr_t) row & 63)) & 63) / 4;
+	if (head > count) head = count;
+
+	if (head)
+	{
+		_mm512_mask_storeu_epi32(row, (__mmask16) ((1u << head) - 1), v);
+		row += head, count -= head;
+	}
+
+	if (stream)
+	{
+		for (; count >= 32; count -= 32, row += 32)
+		{
+			_mm512_stream_si512((__m512i *) (row + 0), v);
+			_mm512_stream_si512((__m512i *) (row + 16), v);
+		}
+	}
+	else
+	{
+		for (; count >= 32; count -= 32, row += 32)
+		{
+			_mm512_store_si512(row + 0, v);
+			_mm512_store_si512(row + 16, v);
+		}
+	}
+
+	for (; count >= 16; count -= 16, row += 16)
+	{
+		_mm512_store_si512(row, v);
+	}
+
+	// Masked tail
+	if (count > 0)
+	{
+		_mm512_mask_storeu_epi32(row, (__mmask16) ((1u << count) - 1), v);
+	}
+}
+
+#endif
+
+// The mask blend kernels used for text. Each channel becomes (colour * a + pixel * (255 - a)) / 255, rounded,
+// computed as (t + (t >> 8)) >> 8 where t = colour * a + pixel * (255 - a) + 128. The kernels all use exactly
+// this formula, so they give identical results.
+void _BlendMaskRowScalar(uint32_t *row, const uint8_t *alpha, int count, uint32_t colour)
+{
+	for (int i = 0; i < count; i++)
+	{
+		uint32_t a = alpha[i];
+		if (!a) continue;
+		uint32_t pixel = row[i], result = 0;
+
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			uint32_t t = ((colour >> shift) & 0xFF) * a + ((pixel >> shift) & 0xFF) * (255 - a) + 128;
+			result |= ((t + (t >> 8)) >> 8) << shift;
+		}
+
+		row[i] = result;
+	}
+}
+
+// The premultiplied blend kernels. Each channel becomes colour + pixel * (255 - a) / 255, with the division
+// rounded the same way as above, and the sum clamped to 255 (which only matters if colour isn't really premultiplied).
+inline uint32_t _BlendPixel(uint32_t pixel, uint32_t colour)
+{
+	uint32_t inverse = 255 - (colour >> 24), result = 0;
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		uint32_t t = ((pixel >> shift) & 0xFF) * inverse + 128;
+		uint32_t channel = ((colour >> shift) & 0xFF) + ((t + (t >> 8)) >> 8);
+		result |= (channel > 255 ? 255 : channel) << shift;
+	}
+
+	return result;
+}
+
+void _BlendRowScalar(uint32_t *row, int count, uint32_t colour)
+{
+	for (int i = 0; i < count; i++)
+	{
+		row[i] = _BlendPixel(row[i], colour);
+	}
+}
+
+void _BlendSpanScalar(uint32_t *row, const uint32_t *source, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		row[i] = _BlendPixel(row[i], source[i]);
+	}
+}
+
+#if ARCH_X64
+
+// Blend channels widened to 16 bits, e.g. 2 pixels per 128 bits
+inline __m128i _BlendChannelsSSE2(__m128i pixels, __m128i alpha, __m128i colour)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(colour, alpha), _mm_mullo_epi16(pixels, _mm_sub_epi16(_mm_set1_epi16(255), alpha)));
+	t = _mm_add_epi16(t, _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+void _BlendMaskRowSSE2(uint32_t *row, const uint8_t *alpha, int count, uint32_t colour)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i colour16 = _mm_unpacklo_epi8(_mm_set1_epi32((int) colour), zero);
+
+	for (; count >= 4; count -= 4, row += 4, alpha += 4)
+	{
+		int32_t alpha4;
+		memcpy(&alpha4, alpha, 4);
+		if (!alpha4) continue;	// the gaps between strokes
+
+		// Repeat each pixel's alpha in all 4 of its bytes
+		__m128i a = _mm_cvtsi32_si128(alpha4);
+		a = _mm_unpacklo_epi8(a, a);
+		a = _mm_unpacklo_epi16(a, a);
+
+		__m128i pixels = _mm_loadu_si128((__m128i *) row);
+		__m128i low = _BlendChannelsSSE2(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(a, zero), colour16);
+		__m128i high = _BlendChannelsSSE2(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(a, zero), colour16);
+		_mm_storeu_si128((__m128i *) row, _mm_packus_epi16(low, high));
+	}
+
+	_BlendMaskRowScalar(row, alpha, count, colour);
+}
+
+TARGET_AVX2 inline __m256i _BlendChannelsAVX2(__m256i pixels, __m256i alpha, __m256i colour)
+{
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(colour, alpha), _mm256_mullo_epi16(pixels, _mm256_sub_epi16(_mm256_set1_epi16(255), alpha)));
+	t = _mm256_add_epi16(t, _mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+TARGET_AVX2 void _BlendMaskRowAVX2(uint32_t *row, const uint8_t *alpha, int count, uint32_t colour)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i colour16 = _mm256_unpacklo_epi8(_mm256_set1_epi32((int) colour), zero);
+
+	for (; count >= 8; count -= 8, row += 8, alpha += 8)
+	{
+		__m128i a = _mm_loadl_epi64((__m128i *) alpha);
+		if (_mm_cvtsi128_si64(a) == 0) continue;
+
+		// Repeat each pixel's alpha in all 4 of its bytes, pixels 0-3 in the low half and 4-7 in the high half
+		a = _mm_unpacklo_epi8(a, a);
+		__m256i a32 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16(a, a)), _mm_unpackhi_epi16(a, a), 1);
+
+		// The unpacks work within each 128 bit half, so the pixels and alphas stay lined up
+		__m256i pixels = _mm256_loadu_si256((__m256i *) row);
+		__m256i low = _BlendChannelsAVX2(_mm256_unpacklo_epi8(pixels, zero), _mm256_unpacklo_epi8(a32, zero), colour16);
+		__m256i high = _BlendChannelsAVX2(_mm256_unpackhi_epi8(pixels, zero), _mm256_unpackhi_epi8(a32, zero), colour16);
+		_mm256_storeu_si256((__m256i *) row, _mm256_packus_epi16(low, high));
+	}
+
+	// The tail is done by the SSE2 kernel, which isn't VEX encoded; clear the upper halves of
+	// the registers first, or mixing the two is very slow on some CPUs
+	_mm256_zeroupper();
+	_BlendMaskRowSSE2(row, alpha, count, colour);
+}
+
+// Scale channels widened to 16 bits by inverse / 255
+inline __m128i _BlendScaleSSE2(__m128i pixels, __m128i inverse)
+{
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(pixels, inverse), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+// Blend 4 premultiplied colours over 4 pixels
+inline __m128i _BlendOverSSE2(__m128i pixels, __m128i colours)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	// 255 - alpha in each 16 bit channel of the pixel
+	__m128i alpha = _mm_srli_epi32(colours, 24);
+	alpha = _mm_or_si128(alpha, _mm_slli_epi32(alpha, 16));
+	__m128i inverseLow = _mm_sub_epi16(_mm_set1_epi16(255), _mm_unpacklo_epi32(alpha, alpha));
+	__m128i inverseHigh = _mm_sub_epi16(_mm_set1_epi16(255), _mm_unpackhi_epi32(alpha, alpha));
+
+	__m128i low = _BlendScaleSSE2(_mm_unpacklo_epi8(pixels, zero), inverseLow);
+	__m128i high = _BlendScaleSSE2(_mm_unpackhi_epi8(pixels, zero), inverseHigh);
+	return _mm_adds_epu8(_mm_packus_epi16(low, high), colours);
+}
+
+void _BlendRowSSE2(uint32_t *row, int count, uint32_t colour)
+{
+	__m128i colours = _mm_set1_epi32((int) colour);
+
+	for (; count >= 4; count -= 4, row += 4)
+	{
+		_mm_storeu_si128((__m128i *) row, _BlendOverSSE2(_mm_loadu_si128((__m128i *) row), colours));
+	}
+
+	_BlendRowScalar(row, count, colour);
+}
+
+void _BlendSpanSSE2(uint32_t *row, const uint32_t *source, int count)
+{
+	for (; count >= 4; count -= 4, row += 4, source += 4)
+	{
+		_mm_storeu_si128((__m128i *) row, _BlendOverSSE2(_mm_loadu_si128((__m128i *) row), _mm_loadu_si128((__m128i *) source)));
+	}
+
+	_BlendSpanScalar(row, source, count);
+}
+
+// Puts 255 - alpha of pixels 0 and 1 (low) or 2 and 3 (high) of each 128 bit lane in all 4 of their 16 bit channels,
+// from the colours with all their bits flipped
+#define BLEND_INVERSE_LOW_SHUFFLE 3, -1, 3, -1, 3, -1, 3, -1, 7, -1, 7, -1, 7, -1, 7, -1
+#define BLEND_INVERSE_HIGH_SHUFFLE 11, -1, 11, -1, 11, -1, 11, -1, 15, -1, 15, -1, 15, -1, 15, -1
+
+TARGET_AVX2 inline __m256i _BlendOverAVX2(__m256i pixels, __m256i colours)
+{
+	__m256i zero = _mm256_setzero_si256();
+	__m256i flipped = _mm256_xor_si256(colours, _mm256_set1_epi32(-1));
+	__m256i inverseLow = _mm256_shuffle_epi8(flipped, _mm256_setr_epi8(BLEND_INVERSE_LOW_SHUFFLE, BLEND_INVERSE_LOW_SHUFFLE));
+	__m256i inverseHigh = _mm256_shuffle_epi8(flipped, _mm256_setr_epi8(BLEND_INVERSE_HIGH_SHUFFLE, BLEND_INVERSE_HIGH_SHUFFLE));
+
+	// The unpacks and pack work within each 128 bit lane, so everything stays lined up
+	__m256i low = _mm256_mullo_epi16(_mm256_unpacklo_epi8(pixels, zero), inverseLow);
+	__m256i high = _mm256_mullo_epi16(_mm256_unpackhi_epi8(pixels, zero), inverseHigh);
+	low = _mm256_add_epi16(low, _mm256_set1_epi16(128));
+	high = _mm256_add_epi16(high, _mm256_set1_epi16(128));
+	low = _mm256_srli_epi16(_mm256_add_epi16(low, _mm256_srli_epi16(low, 8)), 8);
+	high = _mm256_srli_epi16(_mm256_add_epi16(high, _mm256_srli_epi16(high, 8)), 8);
+	return _mm256_adds_epu8(_mm256_packus_epi16(low, high), colours);
+}
+
+TARGET_AVX2 void _BlendRowAVX2(uint32_t *row, int count, uint32_t colour)
+{
+	__m256i colours = _mm256_set1_epi32((int) colour);
+
+	for (; count >= 8; count -= 8, row += 8)
+	{
+		_mm256_storeu_si256((__m256i *) row, _BlendOverAVX2(_mm256_loadu_si256((__m256i *) row), colours));
+	}
+
+	// Masked tail
+	if (count > 0)
+	{
+		__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		_mm256_maskstore_epi32((int *) row, mask, _BlendOverAVX2(_mm256_maskload_epi32((int *) row, mask), colours));
+	}
+}
+
+TARGET_AVX2 void _BlendSpanAVX2(uint32_t *row, const uint32_t *source, int count)
+{
+	for (; count >= 8; count -= 8, row += 8, source += 8)
+	{
+		_mm256_storeu_si256((__m256i *) row, _BlendOverAVX2(_mm256_loadu_si256((__m256i *) row), _mm256_loadu_si256((__m256i *) source)));
+	}
+
+	if (count > 0)
+	{
+		__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		_mm256_maskstore_epi32((int *) row, mask, _BlendOverAVX2(_mm256_maskload_epi32((int *) row, mask), _mm256_maskload_epi32((int *) source, mask)));
+	}
+}
+
+TARGET_AVX512 inline __m512i _BlendOverAVX512(__m512i pixels, __m512i colours)
+{
+	__m512i zero = _mm512_setzero_si512();
+	__m512i flipped = _mm512_xor_si512(colours, _mm512_set1_epi32(-1));
+	// The same shuffles as BLEND_INVERSE_LOW_SHUFFLE and BLEND_INVERSE_HIGH_SHUFFLE, as 32 bit integers
+	__m512i lowShuffle = _mm512_set4_epi32((int) 0xFF07FF07, (int) 0xFF07FF07, (int) 0xFF03FF03, (int) 0xFF03FF03);
+	__m512i highShuffle = _mm512_set4_epi32((int) 0xFF0FFF0F, (int) 0xFF0FFF0F, (int) 0xFF0BFF0B, (int) 0xFF0BFF0B);
+
+	__m512i low = _mm512_mullo_epi16(_mm512_unpacklo_epi8(pixels, zero), _mm512_shuffle_epi8(flipped, lowShuffle));
+	__m512i high = _mm512_mullo_epi16(_mm512_unpackhi_epi8(pixels, zero), _mm512_shuffle_epi8(flipped, highShuffle));
+	low = _mm512_add_epi16(low, _mm512_set1_epi16(128));
+	high = _mm512_add_epi16(high, _mm512_set1_epi16(128));
+	low = _mm512_srli_epi16(_mm512_add_epi16(low, _mm512_srli_epi16(low, 8)), 8);
+	high = _mm512_srli_epi16(_mm512_add_epi16(high, _mm512_srli_epi16(high, 8)), 8);
+	return _mm512_adds_epu8(_mm512_packus_epi16(low, high), colours);
+}
+
+TARGET_AVX512 void _BlendRowAVX512(uint32_t *row, int count, uint32_t colour)
+{
+	__m512i colours = _mm512_set1_epi32((int) colour);
+
+	for (; count >= 16; count -= 16, row += 16)
+	{
+		_mm512_storeu_si512(row, _BlendOverAVX512(_mm512_loadu_si512(row), colours));
+	}
+
+	// Masked tail
+	if (count > 0)
+	{
+		__mmask16 mask = (__mmask16) ((1u << count) - 1);
+		_mm512_mask_storeu_epi32(row, mask, _BlendOverAVX512(_mm512_maskz_loadu_epi32(mask, row), colours));
+	}
+}
+
+TARGET_AVX512 void _BlendSpanAVX512(uint32_t *row, const uint32_t *source, int count)
+{
+	for (; count >= 16; count -= 16, row += 16, source += 16)
+	{
+		_mm512_storeu_si512(row, _BlendOverAVX512(_mm512_loadu_si512(row), _mm512_loadu_si512(source)));
+	}
+
+	if (count > 0)
+	{
+		__mmask16 mask = (__mmask16) ((1u << count) - 1);
+		_mm512_mask_storeu_epi32(row, mask, _BlendOverAVX512(_mm512_maskz_loadu_epi32(mask, row), _mm512_maskz_loadu_epi32(mask, source)));
+	}
+}
+
+void _CPUID(uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+{
+#if COMPILER_MSVC
+	int r[4];
+	__cpuidex(r, (int) leaf, (int) subleaf);
+	registers[0] = r[0], registers[1] = r[1], registers[2] = r[2], registers[3] = r[3];
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+uint64_t _XGETBV()
+{
+#if COMPILER_MSVC
+	return _xgetbv(0);
+#else
+	uint32_t lo, hi;
+	__asm__ volatile ("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((uint64_t) hi << 32) | lo;
+#endif
+}
+
+#endif
+
+bool DrawFillKernelSupported(FillKernel kernel)
+{
+	if (kernel == FILL_KERNEL_SCALAR) return true;
+
+#if ARCH_X64
+	uint32_t leaf1[4], leaf7[4] = {};
+	_CPUID(0, 0, leaf1);
+	uint32_t maxLeaf = leaf1[0];
+	_CPUID(1, 0, leaf1);
+	if (maxLeaf >= 7) _CPUID(7, 0, leaf7);
+
+	// The CPU having the instructions isn't enough, the OS must also save the
+	// wider registers on context switches (XCR0 bits, readable if OSXSAVE is set).
+	bool osxsave = leaf1[2] & (1 << 27);
+	uint64_t xcr0 = osxsave ? _XGETBV() : 0;
+	bool avxState = (xcr0 & 0x06) == 0x06;		// XMM, YMM
+	bool avx512State = (xcr0 & 0xE6) == 0xE6;	// XMM, YMM, opmask, ZMM
+
+	if (kernel == FILL_KERNEL_SSE2) return leaf1[3] & (1 << 26);
+	if (kernel == FILL_KERNEL_AVX2) return avxState && (leaf7[1] & (1 << 5));
+	if (kernel == FILL_KERNEL_AVX512) return avx512State && (leaf7[1] & (1 << 16)) && (leaf7[1] & (1 << 30));
+#endif
+
+	return false;
+}
+
+bool DrawSetFillKernel(FillKernel kernel)
+{
+	if (!DrawFillKernelSupported(kernel))
+	{
+		return false;
+	}
+
+	FillRowFunction functions[FILL_KERNEL_COUNT] = { _FillRowScalar };
+	BlendMaskRowFunction maskFunctions[FILL_KERNEL_COUNT] = { _BlendMaskRowScalar };
+	BlendRowFunction blendFunctions[FILL_KERNEL_COUNT] = { _BlendRowScalar };
+	BlendSpanFunction spanFunctions[FILL_KERNEL_COUNT] = { _BlendSpanScalar };
+#if ARCH_X64
+	functions[FILL_KERNEL_SSE2] = _FillRowSSE2;
+	functions[FILL_KERNEL_AVX2] = _FillRowAVX2;
+	functions[FILL_KERNEL_AVX512] = _FillRowAVX512;
+	maskFunctions[FILL_KERNEL_SSE2] = _BlendMaskRowSSE2;
+	maskFunctions[FILL_KERNEL_AVX2] = _BlendMaskRowAVX2;
+	maskFunctions[FILL_KERNEL_AVX512] = _BlendMaskRowAVX2;	// 8 pixels at a time is plenty for glyphs
+	blendFunctions[FILL_KERNEL_SSE2] = _BlendRowSSE2;
+	blendFunctions[FILL_KERNEL_AVX2] = _BlendRowAVX2;
+	blendFunctions[FILL_KERNEL_AVX512] = _BlendRowAVX512;
+	spanFunctions[FILL_KERNEL_SSE2] = _BlendSpanSSE2;
+	spanFunctions[FILL_KERNEL_AVX2] = _BlendSpanAVX2;
+	spanFunctions[FILL_KERNEL_AVX512] = _BlendSpanAVX512;
+#endif
+
+	global.fillKernel = kernel;
+	global.fillRow = functions[kernel];
+	global.blendMaskRow = maskFunctions[kernel];
+	global.blendRow = blendFunctions[kernel];
+	global.blendSpan = spanFunctions[kernel];
+	return true;
+}
+
+// Called from each backend's Initialise
+void _DrawInitialise()
+{
+	global.layerBudget = LAYER_DEFAULT_BUDGET;
+
+	for (int kernel = FILL_KERNEL_COUNT - 1; kernel >= 0; kernel--)
+	{
+		if (DrawSetFillKernel((FillKernel) kernel))
+		{
+			break;
+		}
+	}
+}
+
+void _ElementInvalidateDisplayList(Element *element)
+{
+	if (element->displayList)
+	{
+		element->displayList->valid = false;
+	}
+}
+
+// Append a command with bytes of parameters to the list, returning where to put the parameters
+void *_DisplayListPush(DisplayList *list, DisplayCommandType type, size_t bytes)
+{
+	bytes += sizeof(DisplayCommand);
+
+	if (list->bytes + bytes > list->capacity)
+	{
+		list->capacity = (list->capacity + bytes) * 2;
+		list->data = (uint8_t *) realloc(list->data, list->capacity);
+	}
+
+	DisplayCommand *command = (DisplayCommand *) (list->data + list->bytes);
+	command->type = (uint16_t) type;
+	command->bytes = (uint16_t) bytes;
+	list->bytes += bytes;
+	return command + 1;
+}
+
+void _DisplayListReplay(DisplayList *list, Painter *painter)
+{
+	for (size_t position = 0; position < list->bytes; )
+	{
+		DisplayCommand *command = (DisplayCommand *) (list->data + position);
+		uint8_t *parameters = (uint8_t *) (command + 1);
+
+		if (command->type == DISPLAY_COMMAND_BLOCK)
+		{
+			Rectangle rectangle;
+			uint32_t colour;
+			memcpy(&rectangle, parameters, sizeof(Rectangle));
+			memcpy(&colour, parameters + sizeof(Rectangle), sizeof(uint32_t));
+			DrawBlock(painter, rectangle, colour);
+		}
+		else if (command->type == DISPLAY_COMMAND_STRING)
+		{
+			Rectangle bounds;
+			uint32_t colour;
+			int size, align;
+			memcpy(&bounds, parameters, sizeof(Rectangle));
+			memcpy(&colour, parameters + sizeof(Rectangle), sizeof(uint32_t));
+			memcpy(&size, parameters + sizeof(Rectangle) + sizeof(uint32_t), sizeof(int));
+			memcpy(&align, parameters + sizeof(Rectangle) + sizeof(uint32_t) + sizeof(int), sizeof(int));
+			size_t offset = sizeof(Rectangle) + sizeof(uint32_t) + 2 * sizeof(int);
+			DrawString(painter, bounds, (const char *) parameters + offset, command->bytes - sizeof(DisplayCommand) - offset, colour, size, align);
+		}
+		else if (command->type == DISPLAY_COMMAND_BLOCK_BLEND)
+		{
+			Rectangle rectangle;
+			uint32_t colour;
+			memcpy(&rectangle, parameters, sizeof(Rectangle));
+			memcpy(&colour, parameters + sizeof(Rectangle), sizeof(uint32_t));
+			DrawBlockBlend(painter, rectangle, colour);
+		}
+		else if (command->type == DISPLAY_COMMAND_GRADIENT)
+		{
+			Rectangle rectangle;
+			uint32_t from, to;
+			int vertical;
+			memcpy(&rectangle, parameters, sizeof(Rectangle));
+			memcpy(&from, parameters + sizeof(Rectangle), sizeof(uint32_t));
+			memcpy(&to, parameters + sizeof(Rectangle) + sizeof(uint32_t), sizeof(uint32_t));
+			memcpy(&vertical, parameters + sizeof(Rectangle) + 2 * sizeof(uint32_t), sizeof(int));
+			DrawGradient(painter, rectangle, from, to, vertical);
+		}
+
+		position += command->bytes;
+	}
+}
+
+void DrawBlock(Painter *painter, Rectangle rectangle, uint32_t colour)
+{
+	if (painter->recording)
+	{
+		// Nothing outside the element's clip can ever be drawn, so don't store it
+		rectangle = RectangleIntersection(painter->clip, rectangle);
+		if (!_RectangleArea(rectangle)) return;
+
+		uint8_t *parameters = (uint8_t *) _DisplayListPush(painter->recording, DISPLAY_COMMAND_BLOCK, sizeof(Rectangle) + sizeof(uint32_t));
+		memcpy(parameters, &rectangle, sizeof(Rectangle));
+		memcpy(parameters + sizeof(Rectangle), &colour, sizeof(uint32_t));
+		return;
+	}
+
+	// Intersect the rectangle we want to fill with the clip, i.e. the rectangle we're allowed to draw into
+	rectangle = RectangleIntersection(painter->clip, rectangle);
+
+	int width = rectangle.r - rectangle.l;
+	if (width <= 0 || rectangle.b <= rectangle.t) return;
+
+	painter->pixelsPainted += (uint64_t) width * (rectangle.b - rectangle.t);
+	bool stream = (size_t) width * (rectangle.b - rectangle.t) * 4 >= DRAW_STREAM_BYTES;
+
+	// for every row inside the rectangle, let the selected kernel fill the span of pixels
+	for (int y = rectangle.t; y < rectangle.b; y++)
+	{
+		// 1-d array as 2-d array y*painter->stride computes row, + x computes column
+		global.fillRow(&painter->bits[(ptrdiff_t) y * painter->stride + rectangle.l], width, colour, stream);
+	}
+
+	// Note that the y loop is the outer one, so that memory access to painter->bits is more sequential
+	// (i.e. it's slightly faster this way)
+
+#if ARCH_X64
+	if (stream)
+	{
+		// Non-temporal stores are weakly ordered; make them visible before the bits are presented
+		_mm_sfence();
+	}
+#endif
+}
+
+uint32_t ColourPremultiply(uint32_t colour)
+{
+	uint32_t alpha = colour >> 24, result = colour & 0xFF000000;
+
+	for (int shift = 0; shift < 24; shift += 8)
+	{
+		uint32_t t = ((colour >> shift) & 0xFF) * alpha + 128;
+		result |= ((t + (t >> 8)) >> 8) << shift;
+	}
+
+	return result;
+}
+
+void DrawBlockBlend(Painter *painter, Rectangle rectangle, uint32_t colour)
+{
+	if ((colour >> 24) == 0xFF)
+	{
+		DrawBlock(painter, rectangle, colour);
+		return;
+	}
+
+	if (!colour)
+	{
+		return;		// completely transparent
+	}
+
+	rectangle = RectangleIntersection(painter->clip, rectangle);
+	int width = rectangle.r - rectangle.l;
+	if (width <= 0 || rectangle.b <= rectangle.t) return;
+
+	if (painter->recording)
+	{
+		uint8_t *parameters = (uint8_t *) _DisplayListPush(painter->recording, DISPLAY_COMMAND_BLOCK_BLEND, sizeof(Rectangle) + sizeof(uint32_t));
+		memcpy(parameters, &rectangle, sizeof(Rectangle));
+		memcpy(parameters + sizeof(Rectangle), &colour, sizeof(uint32_t));
+		return;
+	}
+
+	painter->pixelsPainted += (uint64_t) width * (rectangle.b - rectangle.t);
+
+	for (int y = rectangle.t; y < rectangle.b; y++)
+	{
+		global.blendRow(&painter->bits[(ptrdiff_t) y * painter->stride + rectangle.l], width, colour);
+	}
+}
+
+// The colour at position of 0 to range along a gradient
+uint32_t _GradientColour(uint32_t from, uint32_t to, int position, int range)
+{
+	if (range <= 0) return from;
+	uint32_t result = 0;
+
+	for (int shift = 0; shift < 32; shift += 8)
+	{
+		uint32_t a = (from >> shift) & 0xFF, b = (to >> shift) & 0xFF;
+		result |= ((a * (range - position) + b * position + range / 2) / range) << shift;
+	}
+
+	return result;
+}
+
+#define GRADIENT_CHUNK_PIXELS (256)
+
+void DrawGradient(Painter *painter, Rectangle rectangle, uint32_t from, uint32_t to, bool vertical)
+{
+	Rectangle visible = RectangleIntersection(painter->clip, rectangle);
+	int width = visible.r - visible.l;
+	if (width <= 0 || visible.b <= visible.t) return;
+
+	if (painter->recording)
+	{
+		// The colours depend on the whole rectangle, so it's stored unclipped
+		int verticalParameter = vertical;
+		uint8_t *parameters = (uint8_t *) _DisplayListPush(painter->recording, DISPLAY_COMMAND_GRADIENT, sizeof(Rectangle) + 2 * sizeof(uint32_t) + sizeof(int));
+		memcpy(parameters, &rectangle, sizeof(Rectangle));
+		memcpy(parameters + sizeof(Rectangle), &from, sizeof(uint32_t));
+		memcpy(parameters + sizeof(Rectangle) + sizeof(uint32_t), &to, sizeof(uint32_t));
+		memcpy(parameters + sizeof(Rectangle) + 2 * sizeof(uint32_t), &verticalParameter, sizeof(int));
+		return;
+	}
+
+	painter->pixelsPainted += (uint64_t) width * (visible.b - visible.t);
+	bool opaque = (from >> 24) == 0xFF && (to >> 24) == 0xFF;
+
+	if (vertical)
+	{
+		// Every row is a single colour
+		for (int y = visible.t; y < visible.b; y++)
+		{
+			uint32_t colour = _GradientColour(from, to, y - rectangle.t, rectangle.b - rectangle.t - 1);
+			uint32_t *row = &painter->bits[(ptrdiff_t) y * painter->stride + visible.l];
+			if (opaque) global.fillRow(row, width, colour, false);
+			else global.blendRow(row, width, colour);
+		}
+	}
+	else
+	{
+		// Work out the colours of a chunk of columns once, then copy or blend them into every row
+		uint32_t colours[GRADIENT_CHUNK_PIXELS];
+
+		for (int l = visible.l; l < visible.r; l += GRADIENT_CHUNK_PIXELS)
+		{
+			int count = visible.r - l < GRADIENT_CHUNK_PIXELS ? visible.r - l : GRADIENT_CHUNK_PIXELS;
+
+			for (int i = 0; i < count; i++)
+			{
+				colours[i] = _GradientColour(from, to, l + i - rectangle.l, rectangle.r - rectangle.l - 1);
+			}
+
+			for (int y = visible.t; y < visible.b; y++)
+			{
+				uint32_t *row = &painter->bits[(ptrdiff_t) y * painter->stride + l];
+				if (opaque) memcpy(row, colours, count * sizeof(uint32_t));
+				else global.blendSpan(row, colours, count);
+			}
+		}
+	}
+}
+
+void DrawBorder(Painter *painter, Rectangle r, uint32_t colour, Rectangle borderSize)
+{
+	// Top and bottom edges span the full width; left and right edges fit between them, so no pixel is blended twice.
+	// Edges thicker than half the rectangle are clamped so the bottom and right ones start where the top and left ones end.
+	int top = r.t + borderSize.t < r.b ? r.t + borderSize.t : r.b;
+	int bottom = r.b - borderSize.b > top ? r.b - borderSize.b : top;
+	int left = r.l + borderSize.l < r.r ? r.l + borderSize.l : r.r;
+	int right = r.r - borderSize.r > left ? r.r - borderSize.r : left;
+	DrawBlockBlend(painter, RectangleMake(r.l, r.r, r.t, top), colour);
+	DrawBlockBlend(painter, RectangleMake(r.l, r.r, bottom, r.b), colour);
+	DrawBlockBlend(painter, RectangleMake(r.l, left, top, bottom), colour);
+	DrawBlockBlend(painter, RectangleMake(right, r.r, top, bottom), colour);
+}
+
+void DrawRectangle(Painter *painter, Rectangle r, uint32_t fill, uint32_t border, Rectangle borderSize)
+{
+	DrawBorder(painter, r, border, borderSize);
+	DrawBlockBlend(painter, RectangleMake(r.l + borderSize.l, r.r - borderSize.r, r.t + borderSize.t, r.b - borderSize.b), fill);
+}
+
+////////////////////////////////////
+//- Text
+
+// The built-in font: printable ASCII from font8x8_basic (public domain), 8 rows per character, lowest bit leftmost.
+const uint8_t _fontBitmaps[GLYPH_CHARACTER_COUNT][8] =
+{
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	// ' '
+	{ 0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00 },	// '!'
+	{ 0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	// '"'
+	{ 0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00 },	// '#'
+	{ 0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00 },	// '$'
+	{ 0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00 },	// '%'
+	{ 0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00 },	// '&'
+	{ 0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00 },	// '''
+	{ 0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00 },	// '('
+	{ 0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00 },	// ')'
+	{ 0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00 },	// '*'
+	{ 0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00 },	// '+'
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06 },	// ','
+	{ 0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00 },	// '-'
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00 },	// '.'
+	{ 0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00 },	// '/'
+	{ 0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00 },	// '0'
+	{ 0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00 },	// '1'
+	{ 0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00 },	// '2'
+	{ 0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00 },	// '3'
+	{ 0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00 },	// '4'
+	{ 0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00 },	// '5'
+	{ 0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00 },	// '6'
+	{ 0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00 },	// '7'
+	{ 0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00 },	// '8'
+	{ 0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00 },	// '9'
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00 },	// ':'
+	{ 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06 },	// ';'
+	{ 0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00 },	// '<'
+	{ 0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00 },	// '='
+	{ 0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00 },	// '>'
+	{ 0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00 },	// '?'
+	{ 0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00 },	// '@'
+	{ 0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00 },	// 'A'
+	{ 0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00 },	// 'B'
+	{ 0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00 },	// 'C'
+	{ 0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00 },	// 'D'
+	{ 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00 },	// 'E'
+	{ 0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00 },	// 'F'
+	{ 0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00 },	// 'G'
+	{ 0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00 },	// 'H'
+	{ 0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },	// 'I'
+	{ 0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00 },	// 'J'
+	{ 0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00 },	// 'K'
+	{ 0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00 },	// 'L'
+	{ 0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00 },	// 'M'
+	{ 0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00 },	// 'N'
+	{ 0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00 },	// 'O'
+	{ 0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00 },	// 'P'
+	{ 0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00 },	// 'Q'
+	{ 0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00 },	// 'R'
+	{ 0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00 },	// 'S'
+	{ 0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },	// 'T'
+	{ 0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00 },	// 'U'
+	{ 0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },	// 'V'
+	{ 0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00 },	// 'W'
+	{ 0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00 },	// 'X'
+	{ 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00 },	// 'Y'
+	{ 0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00 },	// 'Z'
+	{ 0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00 },	// '['
+	{ 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00 },	// '\'
+	{ 0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00 },	// ']'
+	{ 0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00 },	// '^'
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF },	// '_'
+	{ 0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00 },	// '`'
+	{ 0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00 },	// 'a'
+	{ 0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00 },	// 'b'
+	{ 0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00 },	// 'c'
+	{ 0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00 },	// 'd'
+	{ 0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00 },	// 'e'
+	{ 0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00 },	// 'f'
+	{ 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F },	// 'g'
+	{ 0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00 },	// 'h'
+	{ 0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },	// 'i'
+	{ 0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E },	// 'j'
+	{ 0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00 },	// 'k'
+	{ 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00 },	// 'l'
+	{ 0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00 },	// 'm'
+	{ 0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00 },	// 'n'
+	{ 0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00 },	// 'o'
+	{ 0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F },	// 'p'
+	{ 0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78 },	// 'q'
+	{ 0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00 },	// 'r'
+	{ 0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00 },	// 's'
+	{ 0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00 },	// 't'
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00 },	// 'u'
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00 },	// 'v'
+	{ 0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00 },	// 'w'
+	{ 0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00 },	// 'x'
+	{ 0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F },	// 'y'
+	{ 0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00 },	// 'z'
+	{ 0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00 },	// '{'
+	{ 0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00 },	// '|'
+	{ 0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00 },	// '}'
+	{ 0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	// '~'
+};
+
+// Find room for a width x height glyph in the atlas, adding a page if the last one is full
+uint8_t *_GlyphAtlasAllocate(int width, int height)
+{
+	GlyphAtlasPage *page = global.glyphPageCount ? &global.glyphPages[global.glyphPageCount - 1] : NULL;
+
+	if (page && page->shelfX + width > GLYPH_ATLAS_PAGE_SIZE)
+	{
+		// Start a new shelf under the current one
+		page->shelfY += page->shelfHeight;
+		page->shelfX = page->shelfHeight = 0;
+	}
+
+	if (!page || page->shelfY + height > GLYPH_ATLAS_PAGE_SIZE)
+	{
+		global.glyphPages = (GlyphAtlasPage *) realloc(global.glyphPages, sizeof(GlyphAtlasPage) * (global.glyphPageCount + 1));
+		page = &global.glyphPages[global.glyphPageCount++];
+		page->alpha = (uint8_t *) calloc(GLYPH_ATLAS_PAGE_SIZE, GLYPH_ATLAS_PAGE_SIZE);
+		page->shelfX = page->shelfY = page->shelfHeight = 0;
+	}
+
+	uint8_t *alpha = page->alpha + page->shelfY * GLYPH_ATLAS_PAGE_SIZE + page->shelfX;
+	page->shelfX += width;
+	if (height > page->shelfHeight) page->shelfHeight = height;
+	return alpha;
+}
+
+// Scale the character's bitmap to size x size pixels. Each pixel covers an (8 / size)^2 area of the
+// bitmap, and its alpha is the fraction of that area that's set, so edges are smoothed at any size.
+void _GlyphRasterize(Glyph *glyph, int character, int size)
+{
+	const uint8_t *bitmap = _fontBitmaps[character - GLYPH_FIRST_CHARACTER];
+	uint8_t *cell = (uint8_t *) malloc(size * size);
+	float scale = 8.0f / size;
+	int l = size, r = 0, t = size, b = 0;
+
+	for (int y = 0; y < size; y++)
+	{
+		for (int x = 0; x < size; x++)
+		{
+			float x0 = x * scale, x1 = x0 + scale, y0 = y * scale, y1 = y0 + scale;
+			float coverage = 0;
+
+			for (int by = (int) y0; by < 8 && by < y1; by++)
+			{
+				float overlapY = (y1 < by + 1 ? y1 : by + 1) - (y0 > by ? y0 : by);
+
+				for (int bx = (int) x0; bx < 8 && bx < x1; bx++)
+				{
+					if (bitmap[by] & (1 << bx))
+					{
+						coverage += ((x1 < bx + 1 ? x1 : bx + 1) - (x0 > bx ? x0 : bx)) * overlapY;
+					}
+				}
+			}
+
+			int alpha = (int) (coverage / (scale * scale) * 255.0f + 0.5f);
+			if (alpha > 255) alpha = 255;
+			cell[y * size + x] = (uint8_t) alpha;
+
+			if (alpha)
+			{
+				if (x < l) l = x;
+				if (x >= r) r = x + 1;
+				if (y < t) t = y;
+				if (y >= b) b = y + 1;
+			}
+		}
+	}
+
+	glyph->ready = true;
+
+	// Only the non-blank part goes in the atlas; blank characters (e.g. spaces) take up no room
+	if (r > l)
+	{
+		glyph->x = (int16_t) l, glyph->y = (int16_t) t;
+		glyph->width = (int16_t) (r - l), glyph->height = (int16_t) (b - t);
+		glyph->alpha = _GlyphAtlasAllocate(r - l, b - t);
+
+		for (int y = t; y < b; y++)
+		{
+			memcpy(glyph->alpha + (y - t) * GLYPH_ATLAS_PAGE_SIZE, cell + y * size + l, r - l);
+		}
+	}
+
+	free(cell);
+}
+
+// Call with global.textMutex held
+Glyph *_GlyphGet(int character, int size)
+{
+	if (character < GLYPH_FIRST_CHARACTER || character >= GLYPH_FIRST_CHARACTER + GLYPH_CHARACTER_COUNT)
+	{
+		character = '?';
+	}
+
+	if (!global.glyphSizes[size])
+	{
+		global.glyphSizes[size] = (Glyph *) calloc(GLYPH_CHARACTER_COUNT, sizeof(Glyph));
+	}
+
+	Glyph *glyph = &global.glyphSizes[size][character - GLYPH_FIRST_CHARACTER];
+	if (!glyph->ready) _GlyphRasterize(glyph, character, size);
+	return glyph;
+}
+
+uint64_t _TextRunHash(const char *string, size_t bytes, int size)
+{
+	// FNV-1a
+	uint64_t hash = 0xCBF29CE484222325 ^ (uint64_t) size;
+
+	for (size_t i = 0; i < bytes; i++)
+	{
+		hash = (hash ^ (uint8_t) string[i]) * 0x100000001B3;
+	}
+
+	return hash;
+}
+
+TextRun *_TextRunCreate(const char *string, size_t bytes, uint64_t hash, int size)
+{
+	TextRun *run = (TextRun *) calloc(1, sizeof(TextRun));
+	StringCopy(&run->string, &run->bytes, string, bytes);
+	run->hash = hash;
+	run->size = size;
+	run->glyphs = (TextRunGlyph *) malloc(sizeof(TextRunGlyph) * (bytes ? bytes : 1));	// at most one per byte
+
+	for (size_t i = 0; i < bytes; i++)
+	{
+		uint8_t character = (uint8_t) string[i];
+
+		// Every UTF-8 sequence is drawn as one character; the font only has ASCII,
+		// so the lead byte gives a '?' and the continuation bytes are skipped
+		if ((character & 0xC0) == 0x80) continue;
+
+		Glyph *glyph = _GlyphGet(character, size);
+
+		if (glyph->alpha)
+		{
+			run->glyphs[run->glyphCount].glyph = glyph;
+			run->glyphs[run->glyphCount].x = run->width;
+			run->glyphCount++;
+		}
+
+		run->width += size;
+	}
+
+	return run;
+}
+
+void _TextRunDestroy(TextRun *run)
+{
+	free(run->string);
+	free(run->glyphs);
+	free(run);
+}
+
+// Look up the run for the string in the cache, laying it out if it isn't there. Call with global.textMutex held.
+// If the run couldn't be cached, *temporary is set and the caller must destroy the run when it's finished with it.
+TextRun *_TextRunGet(const char *string, size_t bytes, int size, bool *temporary)
+{
+	uint64_t hash = _TextRunHash(string, bytes, size);
+	TextRun **set = &global.textRuns[hash % (TEXT_RUN_CACHE_SLOTS / TEXT_RUN_CACHE_WAYS) * TEXT_RUN_CACHE_WAYS];
+	TextRun **oldest = &set[0];
+	*temporary = false;
+
+	for (int i = 0; i < TEXT_RUN_CACHE_WAYS; i++)
+	{
+		TextRun *run = set[i];
+
+		if (run && run->hash == hash && run->size == size && run->bytes == bytes && 0 == memcmp(run->string, string, bytes))
+		{
+			global.textRunHits++;
+			run->lastUsed = global.updateCount;
+			return run;
+		}
+
+		if (!run || (*oldest && run->lastUsed < (*oldest)->lastUsed))
+		{
+			oldest = &set[i];
+		}
+	}
+
+	global.textRunMisses++;
+	TextRun *run = _TextRunCreate(string, bytes, hash, size);
+
+	if (*oldest && (*oldest)->lastUsed == global.updateCount)
+	{
+		// Another paint thread might still be drawing every run in the set, so none can be replaced until the next update
+		*temporary = true;
+		return run;
+	}
+
+	if (*oldest) _TextRunDestroy(*oldest);
+	*oldest = run;
+	run->lastUsed = global.updateCount;
+	return run;
+}
+
+int MeasureString(const char *string, ptrdiff_t bytes, int size)
+{
+	if (bytes == -1) bytes = strlen(string);
+	if (size < 1) return 0;
+	if (size > GLYPH_MAX_SIZE) size = GLYPH_MAX_SIZE;
+
+	std::lock_guard<std::mutex> lock(global.textMutex);
+	bool temporary;
+	TextRun *run = _TextRunGet(string, bytes, size, &temporary);
+	int width = run->width;
+	if (temporary) _TextRunDestroy(run);
+	return width;
+}
+
+void DrawString(Painter *painter, Rectangle bounds, const char *string, ptrdiff_t bytes, uint32_t colour, int size, int align)
+{
+	if (bytes == -1) bytes = strlen(string);
+	if (size < 1) return;
+	if (size > GLYPH_MAX_SIZE) size = GLYPH_MAX_SIZE;
+
+	if (painter->recording)
+	{
+		// Nothing outside the element's clip can ever be drawn, so don't store it
+		if (!_RectangleArea(RectangleIntersection(painter->clip, bounds))) return;
+
+		// Commands are at most 64KB, which is far more text than fits on a line anyway
+		size_t header = sizeof(Rectangle) + sizeof(uint32_t) + 2 * sizeof(int);
+		size_t maximum = UINT16_MAX - sizeof(DisplayCommand) - header;
+		if ((size_t) bytes > maximum) bytes = maximum;
+
+		uint8_t *parameters = (uint8_t *) _DisplayListPush(painter->recording, DISPLAY_COMMAND_STRING, header + bytes);
+		memcpy(parameters, &bounds, sizeof(Rectangle));
+		memcpy(parameters + sizeof(Rectangle), &colour, sizeof(uint32_t));
+		memcpy(parameters + sizeof(Rectangle) + sizeof(uint32_t), &size, sizeof(int));
+		memcpy(parameters + sizeof(Rectangle) + sizeof(uint32_t) + sizeof(int), &align, sizeof(int));
+		memcpy(parameters + header, string, bytes);
+		return;
+	}
+
+	Rectangle clip = RectangleIntersection(painter->clip, bounds);
+	if (!_RectangleArea(clip)) return;
+
+	TextRun *run;
+	bool temporary;
+
+	{
+		std::lock_guard<std::mutex> lock(global.textMutex);
+		run = _TextRunGet(string, bytes, size, &temporary);
+	}
+
+	// The run can't be replaced in the cache until the next update, so it's safe to use without the lock
+	int x = bounds.l;
+	if (align == TEXT_ALIGN_CENTER) x += (bounds.r - bounds.l - run->width) / 2;
+	else if (align == TEXT_ALIGN_RIGHT) x = bounds.r - run->width;
+	int y = bounds.t + (bounds.b - bounds.t - size) / 2;
+
+	for (uint32_t i = 0; i < run->glyphCount; i++)
+	{
+		Glyph *glyph = run->glyphs[i].glyph;
+		int l = x + run->glyphs[i].x + glyph->x, t = y + glyph->y;
+		if (l >= clip.r) break;		// the rest of the run is clipped too
+
+		Rectangle visible = RectangleIntersection(clip, RectangleMake(l, l + glyph->width, t, t + glyph->height));
+		int width = visible.r - visible.l;
+		if (width <= 0 || visible.b <= visible.t) continue;
+		painter->pixelsPainted += (uint64_t) width * (visible.b - visible.t);
+
+		const uint8_t *alpha = glyph->alpha + (visible.t - t) * GLYPH_ATLAS_PAGE_SIZE + (visible.l - l);
+
+		for (int row = visible.t; row < visible.b; row++, alpha += GLYPH_ATLAS_PAGE_SIZE)
+		{
+			global.blendMaskRow(&painter->bits[(ptrdiff_t) row * painter->stride + visible.l], alpha, width, colour);
+		}
+	}
+
+	if (temporary) _TextRunDestroy(run);
+}
+
 ////////////////////////////////////
-//- Core UI Logic
+//- Boxes
 
-void _WindowEndPaint(Window *window, Painter *painter);
+int _BoxPadding(Box *box, int axis)
+{
+	return axis ? box->padding.t + box->padding.b : box->padding.l + box->padding.r;
+}
 
-void _ElementPaint(Element *element, Painter *painter)
+int _BoxGaps(Box *box, uint32_t count)
+{
+	return count > 1 ? box->gap * (int) (count - 1) : 0;
+}
+
+// What's left of space for a fill part, once the other parts (fixed pixels in total) have had their
+// preferred size. The first fill parts get a pixel more when it doesn't divide exactly.
+int _BoxShare(int space, int fixed, int fillCount, int fillIndex)
 {
-	// Compute the intersection of where the element is allowed to draw, element->clip,
-	// with the area requested to be drawn, painter->clip
-	Rectangle clip = RectangleIntersection(element->clip, painter->clip);
+	int left = space - fixed;
+	if (left < 0) left = 0;
+	return left / fillCount + (fillIndex < left % fillCount ? 1 : 0);
+}
+
+// Total preferred size of a row's or column's children along it (axis 0 for a row, 1 for a column), each
+// measured with cross pixels across. Also counts how much of it is from children that don't fill.
+int _BoxLineMeasure(Box *box, int axis, int cross, int *fixed, int *fillCount)
+{
+	uint32_t fill = axis ? ELEMENT_V_FILL : ELEMENT_H_FILL;
+	int total = 0;
+	*fixed = *fillCount = 0;
 
-	// If the above regions do not overlap, return here,
-	// and do not recurse into our descendant elements
-	// (since their clip rectangles are contained within element->clip)
-	if (!RectangleValid(clip))
+	for (uint32_t i = 0; i < box->e.childCount; i++)
 	{
-		return;
+		Element *child = box->e.children[i];
+		int size = _ElementMeasure(child, axis, cross);
+		total += size;
+
+		if (child->flags & fill) (*fillCount)++;
+		else *fixed += size;
 	}
 
-	// Set the pointer's clip and ask the element to paint itself
-	painter->clip = clip;
-	ElementMessage(element, MSG_PAINT, 0, painter);
+	return total;
+}
 
-	// Recurse into each child, restoring the clip each time
-	for (uintptr_t i = 0; i < element->childCount; i++)
+// The child's size along the line, given space pixels for all the children, or -1 if that's not known yet.
+// Only the fill children need fillIndex; call this for the children in order.
+int _BoxLineSize(Element *child, int axis, int cross, int space, int fixed, int fillCount, int *fillIndex)
+{
+	if (space < 0 || !(child->flags & (axis ? ELEMENT_V_FILL : ELEMENT_H_FILL)))
 	{
-		painter->clip = clip;
-		_ElementPaint(element->children[i], painter);
+		return _ElementMeasure(child, axis, cross);
 	}
+
+	return _BoxShare(space, fixed, fillCount, (*fillIndex)++);
 }
 
-void _Update()
+// Work out the grid's column widths for space pixels (not counting gaps), or the preferred widths
+// if space is -1. Returns the total preferred width. Columns are measured without a height.
+int _BoxGridColumns(Box *box, int space)
 {
-	for (uintptr_t i = 0; i < global.windowCount; i++)
+	int columns = box->columns > 1 ? box->columns : 1;
+
+	if (columns > box->gridColumnCapacity)
 	{
-		Window *window = global.windows[i];
+		box->gridColumnCapacity = columns;
+		box->gridColumns = (BoxColumn *) realloc(box->gridColumns, sizeof(BoxColumn) * columns);
+	}
 
-		// Is there anything marked for repaint?
-		if (RectangleValid(window->updateRegion))
-		{
-			// Setup the painter using the window's buffer
-			Painter painter;
-			painter.bits = window->bits;
-			painter.width = window->width;
-			painter.height = window->height;
-			painter.clip = RectangleIntersection(RectangleMake(0, window->width, 0, window->height), window->updateRegion);
+	for (int i = 0; i < columns; i++)
+	{
+		box->gridColumns[i] = {};
+	}
+
+	for (uint32_t i = 0; i < box->e.childCount; i++)
+	{
+		Element *child = box->e.children[i];
+		BoxColumn *column = &box->gridColumns[i % columns];
+		int width = _ElementMeasure(child, 0, 0);
+		if (width > column->width) column->width = width;
+		if (child->flags & ELEMENT_H_FILL) column->fill = true;
+	}
 
-			// Paint everything in the update region
-			_ElementPaint(&window->e, &painter);
+	int total = 0, fixed = 0, fillCount = 0;
 
-			// Tell the platform layer to put the result onto the screen
-			_WindowEndPaint(window, &painter);
+	for (int i = 0; i < columns; i++)
+	{
+		total += box->gridColumns[i].width;
+		if (box->gridColumns[i].fill) fillCount++;
+		else fixed += box->gridColumns[i].width;
+	}
 
-			// Clear the update region, ready for the next input event cycle
-			window->updateRegion = RectangleMake(0, 0, 0, 0);
+	for (int i = 0, fillIndex = 0; i < columns && space >= 0; i++)
+	{
+		if (box->gridColumns[i].fill)
+		{
+			box->gridColumns[i].width = _BoxShare(space, fixed, fillCount, fillIndex++);
 		}
 	}
+
+	return total;
 }
 
-// Invariant:  each element is responsible for the positioning of its children and nothing more.
-// Moves an element and triggers layout if needed
-void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout)
+// Height of a grid row, once the column widths are known: its tallest child, measured with its column's width
+int _BoxGridRowHeight(Box *box, uint32_t row, bool *fill)
 {
-	// save the previous visible area to detect changes
-	Rectangle oldClip = element->clip;
-	// compute the new visible region:
-	//	- element's bounds
-	// 	- clipped by parent's visible area
-	// Enforces clipping automatically
-	element->clip = RectangleIntersection(element->parent->clip, bounds);
+	uint32_t columns = box->columns > 1 ? box->columns : 1;
+	int height = 0;
+	*fill = false;
 
-	// only re-layout if:
-	// 	- bounds changed, OR
-	// 	- visible region changed, OR
-	// 	- caller forces it (alwaysLayout)
-	// to prevent unnecessary layout propagration
-	if (!RectangleEquals(element->bounds, bounds)
-					|| !RectangleEquals(element->clip, oldClip)
-					|| alwaysLayout)
+	for (uint32_t i = row * columns; i < box->e.childCount && i < (row + 1) * columns; i++)
 	{
-		// commit new bounds
-		element->bounds = bounds;
-		// notify the element: "Your bounds/clip changed; reposition your children"
-		ElementMessage(element, MSG_LAYOUT, 0, 0);
+		Element *child = box->e.children[i];
+		int childHeight = _ElementMeasure(child, 1, box->gridColumns[i - row * columns].width);
+		if (childHeight > height) height = childHeight;
+		if (child->flags & ELEMENT_V_FILL) *fill = true;
 	}
+
+	return height;
 }
 
-void ElementRepaint(Element *element, Rectangle *region)
+uint32_t _BoxGridRows(Box *box)
 {
-	if (!region)
+	uint32_t columns = box->columns > 1 ? box->columns : 1;
+	return (box->e.childCount + columns - 1) / columns;
+}
+
+uint32_t _BoxGridColumnsUsed(Box *box)
+{
+	uint32_t columns = box->columns > 1 ? box->columns : 1;
+	return box->e.childCount < columns ? box->e.childCount : columns;
+}
+
+// Answer MSG_GET_WIDTH (axis 0) or MSG_GET_HEIGHT (axis 1), given constraint pixels in the other direction.
+// Boxes always measure their children's widths without a height, and their heights with the width they'll get,
+// so a child is asked the same thing each time and its cached answer can be used. This means a box's own
+// preferred width doesn't depend on the height it's given.
+int _BoxMeasure(Box *box, int axis, int constraint)
+{
+	int padding = _BoxPadding(box, axis);
+	bool grid = box->e.flags & BOX_GRID, row = box->e.flags & BOX_ROW;
+	int gaps = grid ? _BoxGaps(box, _BoxGridColumnsUsed(box)) : row ? _BoxGaps(box, box->e.childCount) : 0;
+	int width = -1, fixed, fillCount, fillIndex = 0, size = 0;
+
+	if (axis && constraint)
 	{
-		// If the region to repaint was not specified, use the whole bounds of the element
-		region = &element->bounds;
+		// The width the children get between them
+		width = constraint - _BoxPadding(box, 0) - gaps;
+		if (width < 0) width = 0;
 	}
 
-	// Intersect the region to repaint with the element's clip
-	Rectangle r = RectangleIntersection(*region, element->clip);
+	if (grid && !axis)
+	{
+		return padding + _BoxGridColumns(box, -1) + gaps;
+	}
+	else if (grid)
+	{
+		_BoxGridColumns(box, width);
+		uint32_t rows = _BoxGridRows(box);
+		bool fill;
 
-	// if the intersection is non-empty...
-	if (RectangleValid(r))
+		for (uint32_t i = 0; i < rows; i++)
+		{
+			size += _BoxGridRowHeight(box, i, &fill);
+		}
+
+		return padding + size + _BoxGaps(box, rows);
+	}
+	else if (row && !axis)
+	{
+		return padding + _BoxLineMeasure(box, 0, 0, &fixed, &fillCount) + gaps;
+	}
+	else if (row)
 	{
-		// Set the window's updateRegion to be the smallest rectangle containing both
-		// the previous value of the updateRegion and the new rectangle we need to repaint
-		if (RectangleValid(element->window->updateRegion))
+		// The tallest child, given the width it would get
+		_BoxLineMeasure(box, 0, 0, &fixed, &fillCount);
+
+		for (uint32_t i = 0; i < box->e.childCount; i++)
 		{
-			element->window->updateRegion = RectangleBounding(element->window->updateRegion, r);
+			Element *child = box->e.children[i];
+			int childHeight = _ElementMeasure(child, 1, _BoxLineSize(child, 0, 0, width, fixed, fillCount, &fillIndex));
+			if (childHeight > size) size = childHeight;
 		}
-		else
+
+		return padding + size;
+	}
+	else if (!axis)
+	{
+		// The widest child
+		for (uint32_t i = 0; i < box->e.childCount; i++)
 		{
-			element->window->updateRegion = r;
+			int childWidth = _ElementMeasure(box->e.children[i], 0, 0);
+			if (childWidth > size) size = childWidth;
 		}
+
+		return padding + size;
+	}
+	else
+	{
+		return padding + _BoxLineMeasure(box, 1, width > 0 ? width : 0, &fixed, &fillCount) + _BoxGaps(box, box->e.childCount);
 	}
 }
 
-// Two-layer message dispatch with user override and class falback
-// Dispatch a messeage to an element
-// User handler is given first refusal:
-// 	- non-zero return means "handled" -> stop dispatch
-// 	- zero return means "not handled" -> fall through
-// If the user handler declines, the class (default) handler runs
-// The return value indicates whether the message was untlimately handled
-int ElementMessage(Element *element, Message message, int di, void *dp)
+// Move a child, repainting where it was and where it's gone if it's actually moved
+void _BoxPlace(Element *child, Rectangle bounds)
 {
-	if (element->messageUser)
+	bool moved = !RectangleEquals(child->bounds, bounds);
+	if (moved) ElementRepaint(child, NULL);
+	ElementMove(child, bounds, false);
+	if (moved) ElementRepaint(child, NULL);
+}
+
+void _BoxLayout(Box *box)
+{
+	Rectangle inner = box->e.bounds;
+	inner.l += box->padding.l, inner.r -= box->padding.r;
+	inner.t += box->padding.t, inner.b -= box->padding.b;
+	int width = inner.r > inner.l ? inner.r - inner.l : 0;
+	int height = inner.b > inner.t ? inner.b - inner.t : 0;
+
+	if (box->e.flags & BOX_GRID)
 	{
-		int result = element->messageUser(element, message, di, dp);
+		uint32_t columns = box->columns > 1 ? box->columns : 1;
+		uint32_t rows = _BoxGridRows(box);
+		int space = width - _BoxGaps(box, _BoxGridColumnsUsed(box));
+		_BoxGridColumns(box, space > 0 ? space : 0);
 
-		if (result)
+		// The rows' preferred heights first, to know what's left for the fill rows
+		int fixed = 0, fillCount = 0, fillIndex = 0;
+		bool fill;
+
+		for (uint32_t i = 0; i < rows; i++)
 		{
-			return result;
+			int rowHeight = _BoxGridRowHeight(box, i, &fill);
+			if (fill) fillCount++;
+			else fixed += rowHeight;
 		}
-		else
+
+		space = height - _BoxGaps(box, rows);
+		int y = inner.t;
+
+		for (uint32_t i = 0; i < rows; i++)
 		{
-			// keep going!
+			int rowHeight = _BoxGridRowHeight(box, i, &fill);
+			if (fill) rowHeight = _BoxShare(space, fixed, fillCount, fillIndex++);
+			int x = inner.l;
+
+			for (uint32_t j = 0; j < columns && i * columns + j < box->e.childCount; j++)
+			{
+				int columnWidth = box->gridColumns[j].width;
+				_BoxPlace(box->e.children[i * columns + j], RectangleMake(x, x + columnWidth, y, y + rowHeight));
+				x += columnWidth + box->gap;
+			}
+
+			y += rowHeight + box->gap;
 		}
-	}
 
-	if (element->messageClass)
-	{
-		return element->messageClass(element, message, di, dp);
+		return;
 	}
-	else
+
+	int main = (box->e.flags & BOX_ROW) ? 0 : 1;
+	int cross = main ? width : 0;	// as in _BoxMeasure
+	int space = (main ? height : width) - _BoxGaps(box, box->e.childCount);
+	int fixed, fillCount, fillIndex = 0;
+	_BoxLineMeasure(box, main, cross, &fixed, &fillCount);
+	int position = main ? inner.t : inner.l;
+
+	for (uint32_t i = 0; i < box->e.childCount; i++)
 	{
-		return 0;
+		Element *child = box->e.children[i];
+		int size = _BoxLineSize(child, main, cross, space > 0 ? space : 0, fixed, fillCount, &fillIndex);
+		_BoxPlace(child, main ? RectangleMake(inner.l, inner.l + width, position, position + size)
+				: RectangleMake(position, position + size, inner.t, inner.t + height));
+		position += size + box->gap;
 	}
 }
 
-
-Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass)
+int _BoxMessage(Element *element, Message message, int di, void *dp)
 {
-	Element *element = (Element *) calloc(1, bytes);
-	element->flags = flags;
-	element->messageClass = messageClass;
+	(void) dp;
+	Box *box = (Box *) element;
 
-	if (parent)		// element is not the root
+	if (message == MSG_GET_WIDTH)
 	{
-		element->window = parent->window;
-		element->parent = parent;
-		parent->childCount++;
-		parent->children = (Element **)realloc(parent->children, sizeof(Element *) * parent->childCount);
-		parent->children[parent->childCount - 1] = element;
+		return _BoxMeasure(box, 0, di);
 	}
-	return element;
+	else if (message == MSG_GET_HEIGHT)
+	{
+		return _BoxMeasure(box, 1, di);
+	}
+	else if (message == MSG_LAYOUT)
+	{
+		_BoxLayout(box);
+	}
+	else if (message == MSG_DESTROY)
+	{
+		free(box->gridColumns);
+	}
+
+	return 0;
 }
 
+Box *BoxCreate(Element *parent, uint32_t flags)
+{
+	Box *box = (Box *) ElementCreate(sizeof(Box), parent, flags, _BoxMessage);
+	box->columns = 1;
+	return box;
+}
 
 ////////////////////////////////////
-//- Helpers
-Rectangle RectangleMake(int l, int r, int t, int b)
+//- Event recording
+
+// Called by the backends for each platform event MessageLoop handles
+void _EventRecord(RecordedEventType type, Window *window, int a, int b, int c, int d)
 {
-	return Rectangle{l, r, t, b};
+	if (!global.eventRecording)
+	{
+		return;
+	}
+
+	// Carry the part under a microsecond over to the next event, so the delays don't drift
+	uint64_t delay = (_TimeNow() - global.eventRecordTime) / 1000;
+	global.eventRecordTime += delay * 1000;
+
+	RecordedEvent event = {};
+	event.delay = delay > UINT32_MAX ? UINT32_MAX : (uint32_t) delay;
+	event.type = (uint16_t) type;
+
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		if (global.windows[i] == window) event.window = (uint16_t) i;
+	}
+
+	int values[4] = { a, b, c, d };
+
+	for (int i = 0; i < 4; i++)
+	{
+		event.values[i] = (int16_t) (values[i] < INT16_MIN ? INT16_MIN : values[i] > INT16_MAX ? INT16_MAX : values[i]);
+	}
+
+	fwrite(&event, sizeof(event), 1, global.eventRecording);
+	global.eventRecordBatchOpen = type != RECORDED_EVENT_BATCH;
 }
 
-// valid if width and height are positive
-bool RectangleValid(Rectangle a)
+// Called by the backends once a batch of events has been handled
+void _EventRecordBatch()
 {
-	bool valid = true;
+	if (global.eventRecordBatchOpen)
+	{
+		_EventRecord(RECORDED_EVENT_BATCH, NULL, 0, 0, 0, 0);
+	}
+}
 
-	if ((a.r - a.l) < 0) valid = false;
-	if ((a.b - a.t) < 0) valid = false;
+void EventRecordStop()
+{
+	if (!global.eventRecording)
+	{
+		return;
+	}
 
-	return valid;
+	_EventRecordBatch();
+	fclose(global.eventRecording);
+	global.eventRecording = NULL;
 }
 
-// Compute the intersection of the rectangles, i.e. the biggest rectangle that fits 
-// into both. If the rectangles don't overlap, an invalid rectangle is returned 
-// (as per RectangleValid).
-Rectangle RectangleIntersection(Rectangle a, Rectangle b)
+bool EventRecordStart(const char *path)
 {
-	// where do both rectangles exist at the same time, an AND operation
-	if (a.l < b.l) a.l = b.l;
-	if (a.t < b.t) a.t = b.t;
-	if (a.r > b.r) a.r = b.r;
-	if (a.b > b.b) a.b = b.b;
+	EventRecordStop();
+	global.eventRecording = fopen(path, "wb");
 
-	return a;
+	if (!global.eventRecording)
+	{
+		return false;
+	}
+
+	uint32_t magic = EVENT_RECORD_MAGIC;
+	fwrite(&magic, sizeof(magic), 1, global.eventRecording);
+	global.eventRecordTime = _TimeNow();
+	global.eventRecordBatchOpen = false;
+	return true;
 }
 
-// Compute the smallest rectangle containing both of the input rectangles.
-Rectangle RectangleBounding(Rectangle a, Rectangle b)
+////////////////////////////////////
+//- Platform code
+
+// Does bits need reallocating for the window's width and height? If so, returns the new stride and capacityHeight.
+bool _FramebufferNeedsResize(Window *window, int *stride, int *capacityHeight)
 {
-	// what is the minimum rectangle that encloses both, an OR operation
-	if (a.l > b.l) a.l = b.l;
-	if (a.t > b.t) a.t = b.t;
-	if (a.r < b.r) a.r = b.r;
-	if (a.b < b.b) a.b = b.b;
+	size_t capacity = (size_t) window->stride * window->capacityHeight;
+	size_t needed = (size_t) window->width * window->height;
+	bool fits = window->bits && window->width <= window->stride && window->height <= window->capacityHeight;
 
-	return a; 
+	if (window->bits && (!window->width || !window->height))
+	{
+		// Minimised; keep the bits for when the window is restored
+		return false;
+	}
+
+	if (fits && needed >= capacity / FRAMEBUFFER_SHRINK_FACTOR)
+	{
+		return false;
+	}
+
+	int width = window->width + window->width * FRAMEBUFFER_GROWTH_PERCENT / 100;
+	*stride = (width + FRAMEBUFFER_ALIGN_PIXELS - 1) / FRAMEBUFFER_ALIGN_PIXELS * FRAMEBUFFER_ALIGN_PIXELS;
+	*capacityHeight = window->height + window->height * FRAMEBUFFER_GROWTH_PERCENT / 100;
+	if (*stride < FRAMEBUFFER_ALIGN_PIXELS) *stride = FRAMEBUFFER_ALIGN_PIXELS;
+	if (*capacityHeight < 1) *capacityHeight = 1;
+	return true;
 }
 
-// Returns true if all sides are equal.
-bool RectangleEquals(Rectangle a, Rectangle b)
+// Sets *mapped if the bits came from mmap, so _FramebufferFree can release them the same way
+uint32_t *_FramebufferAllocate(size_t bytes, bool *mapped)
 {
-	bool equal = false;
-	if (a.l == b.l && a.t == b.t && a.r == b.r && a.b == b.b)
-		equal = true;
+	*mapped = false;
 
-	return equal;
+#if defined(__linux__)
+	if (bytes >= FRAMEBUFFER_HUGE_PAGE_BYTES)
+	{
+		void *bits = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (bits != MAP_FAILED)
+		{
+			// Only a hint; without transparent huge pages this is an ordinary mapping
+			madvise(bits, bytes, MADV_HUGEPAGE);
+			*mapped = true;
+			return (uint32_t *) bits;
+		}
+	}
+#endif
+
+	return (uint32_t *) malloc(bytes);
 }
 
-// Returns true if the pixel with its top-left at the given coordinate is contained 
-// inside the rectangle.
-bool RectangleContains(Rectangle a, int x, int y)
+void _FramebufferFree(uint32_t *bits, size_t bytes, bool mapped)
 {
-	// (x, y) gives the top-left corner of the pixel. (treating pixel as 1x1 pixel square/rectangle: l,r,t,b [x, x), [y, y) )
-	// x ∈ [a.l, a.r)
-	// y ∈ [a.t, a.b)
+	if (!bits) return;
 
-	// Therefore we use strict inequalities when comparing against the right 
-	// and bottom sides of the rectangle.
-	return a.l <= x && a.r > x && a.t <= y && a.b > y;
+#if defined(__linux__)
+	if (mapped)
+	{
+		munmap(bits, bytes);
+		return;
+	}
+#endif
+
+	free(bits);
 }
 
-void StringCopy(char **destination, size_t *destinationBytes, const char *source, ptrdiff_t sourceBytes)
+// Make bits big enough for the window's width and height. The contents are undefined
+// afterwards, which is fine since a resize repaints the whole window.
+void _WindowReserveBits(Window *window)
 {
-	if (sourceBytes == -1) sourceBytes = strlen(source);
-	*destination = (char *) realloc(*destination, sourceBytes);
-	*destinationBytes = sourceBytes;
-	memcpy(*destination, source, sourceBytes);
-}
+	int stride, capacityHeight;
+	if (!_FramebufferNeedsResize(window, &stride, &capacityHeight)) return;
 
-////////////////////////////////////
-//- Painting
+	_FramebufferFree(window->bits, (size_t) window->stride * window->capacityHeight * 4, window->bitsMapped);
+	window->bits = _FramebufferAllocate((size_t) stride * capacityHeight * 4, &window->bitsMapped);
+	window->stride = stride;
+	window->capacityHeight = capacityHeight;
+	window->bitsAllocationCount++;
+}
 
-void DrawBlock(Painter *painter, Rectangle rectangle, uint32_t colour)
+// Message handler of the window element, shared by all backends
+int _WindowMessage(Element *element, Message message, int di, void *dp)
 {
-	// Intersect the rectangle we want to fill with the clip, i.e. the rectangle we're allowed to draw into
-	rectangle = RectangleIntersection(painter->clip, rectangle);
+	(void) di;
+	(void) dp;
 
-	// for every pixel inside the rectangle
-	for (int y = rectangle.t; y < rectangle.b; y++)			// row
+	if (message == MSG_LAYOUT && element->childCount)
 	{
-		for (int x = rectangle.l; x < rectangle.r; x++)		// column
-		{
-			// Set the pixel to the given colour
-			painter->bits[y * painter->width + x] = colour;	// 1-d array as 2-d array y*painter->width computes row, + x computes column
-		}
+		ElementMove(element->children[0], element->bounds, false);
+		ElementRepaint(element, NULL);
 	}
 
-	// Note that the y loop is the outer one, so that memory access to painter->bits is more sequential
-	// (i.e. it's slightly faster this way)
+	return 0;
 }
 
-////////////////////////////////////
-//- Platform code
-
 #if OS_WINDOWS
 LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 {
@@ -285,6 +4199,8 @@ LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 
 	if (message == WM_CLOSE)
 	{
+		_EventRecord(RECORDED_EVENT_CLOSE, window, 0, 0, 0, 0);
+		EventRecordStop();
 		PostQuitMessage(0);
 	}
 	else if (message == WM_SIZE)
@@ -292,21 +4208,26 @@ LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 		OutputDebugStringA("WM_SIZE\n");
 		RECT client;
 		GetClientRect(hwnd, &client);
+		_EventRecord(RECORDED_EVENT_RESIZE, window, client.right, client.bottom, 0, 0);
+		_EventRecordBatch();
 		window->width = client.right;
 		window->height = client.bottom;
-		window->bits = (uint32_t *) realloc(window->bits, window->width * window->height * 4);
+		_WindowReserveBits(window);
 		window->e.bounds = RectangleMake(0, window->width, 0, window->height);
 		window->e.clip = RectangleMake(0, window->width, 0, window->height);
-		ElementMessage(&window->e, MSG_LAYOUT, 0, 0);
+		_ElementSync(&window->e);
+		ElementRelayout(&window->e);
 		_Update();
 	}
 	else if (message == WM_PAINT)
 	{
 		PAINTSTRUCT paint;
 		HDC dc = BeginPaint(hwnd, &paint);
+		_EventRecord(RECORDED_EVENT_EXPOSE, window, paint.rcPaint.left, paint.rcPaint.right, paint.rcPaint.top, paint.rcPaint.bottom);
+		_EventRecordBatch();
 		BITMAPINFOHEADER info = { 0 };
 		info.biSize = sizeof(info);
-		info.biWidth = window->width, info.biHeight = -window->height;
+		info.biWidth = window->stride, info.biHeight = -window->height;
 		info.biPlanes = 1, info.biBitCount = 32;
 		StretchDIBits(dc, 0, 0, window->e.bounds.r - window->e.bounds.l, window->e.bounds.b - window->e.bounds.t, 
 				0, 0, window->e.bounds.r - window->e.bounds.l, window->e.bounds.b - window->e.bounds.t,
@@ -321,18 +4242,9 @@ LRESULT CALLBACK _WindowProcedure(HWND hwnd, UINT message, WPARAM wParam, LPARAM
 	return 0;
 }
 
-int _WindowMessage(Element *element, Message message, int di, void *dp)
+void _WindowBeginPaint(Window *window)
 {
-	(void) di;
-	(void) dp;
-
-	if (message == MSG_LAYOUT && element->childCount)
-	{
-		ElementMove(element->children[0], element->bounds, false);
-		ElementRepaint(element, NULL);
-	}
-
-	return 0;
+	(void) window;
 }
 
 void _WindowEndPaint(Window *window, Painter *painter)
@@ -341,25 +4253,27 @@ void _WindowEndPaint(Window *window, Painter *painter)
 	HDC dc = GetDC(window->hwnd);
 	BITMAPINFOHEADER info = { 0 };
 	info.biSize = sizeof(info);
-	info.biWidth = window->width, info.biHeight = window->height;
+	info.biWidth = window->stride, info.biHeight = window->height;
 	info.biPlanes = 1, info.biBitCount = 32;
 	// Note: biHeight is positive, so the DIB is bottom-up.
 	// GDI treats y=0 as the bottom of the bitmap, while our renderer
 	// treats y=0 as the top. The unusual ySrc / SrcHeight values
 	// compensate for this inverted Y axis.
-	StretchDIBits(dc, 
-		window->updateRegion.l, window->updateRegion.t, 
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.b - window->updateRegion.t,
-		window->updateRegion.l, window->updateRegion.b + 1, 
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.t - window->updateRegion.b,
-		window->bits, (BITMAPINFO *) &info, DIB_RGB_COLORS, SRCCOPY);
+	for (int i = 0; i < window->updateRegion.count; i++)
+	{
+		Rectangle r = window->updateRegion.rectangles[i];
+		StretchDIBits(dc, 
+			r.l, r.t, r.r - r.l, r.b - r.t,
+			r.l, r.b + 1, r.r - r.l, r.t - r.b,
+			window->bits, (BITMAPINFO *) &info, DIB_RGB_COLORS, SRCCOPY);
+	}
 	ReleaseDC(window->hwnd, dc);
 }
 
 Window *WindowCreate(const char *cTitle, int width, int height)
 {
 	// Window *window = (Window *) calloc(1, sizeof(Window));
-	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, 0, _WindowMessage);
+	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, ELEMENT_PAINT_THREAD_SAFE, _WindowMessage);
 	window->e.window = window;
 	global.windowCount++;
 	global.windows = (Window **)realloc(global.windows, sizeof(Window *) * global.windowCount);
@@ -373,17 +4287,46 @@ Window *WindowCreate(const char *cTitle, int width, int height)
 	return window;
 }
 
+void WindowDestroy(Window *window)
+{
+	SetWindowLongPtr(window->hwnd, GWLP_USERDATA, 0);
+	DestroyWindow(window->hwnd);
+	_FramebufferFree(window->bits, (size_t) window->stride * window->capacityHeight * 4, window->bitsMapped);
+	_WindowDestroyElements(window);
+}
+
 int MessageLoop()
 {
-	MSG message = {};
+	_Update();
 
-	while (GetMessage(&message, NULL, 0, 0))
+	while (true)
 	{
-		TranslateMessage(&message);
-		DispatchMessage(&message);
-	}
+		uint64_t deadline = _MessageLoopTick();
+		DWORD timeout = INFINITE;
+
+		if (deadline != UINT64_MAX)
+		{
+			// Round up, so we don't wake up just before the deadline and spin
+			uint64_t now = _TimeNow();
+			timeout = deadline > now ? (DWORD) ((deadline - now + 999999) / 1000000) : 0;
+		}
+
+		// Sleep until there's a window message, MessageLoopPost is called, or the deadline passes
+		MsgWaitForMultipleObjects(1, &global.wakeEvent, FALSE, timeout, QS_ALLINPUT);
+
+		MSG message = {};
+
+		while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE))
+		{
+			if (message.message == WM_QUIT)
+			{
+				return message.wParam;
+			}
 
-	return message.wParam;
+			TranslateMessage(&message);
+			DispatchMessage(&message);
+		}
+	}
 }
 
 void Initialise()
@@ -393,6 +4336,8 @@ void Initialise()
 	windowClass.hCursor = LoadCursor(NULL, IDC_ARROW);
 	windowClass.lpszClassName = "UILibraryTutorial";
 	RegisterClass(&windowClass);
+	global.wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	_DrawInitialise();
 }
 
 #endif
@@ -409,34 +4354,162 @@ Window *_FindWindow(X11Window window) {
 	return NULL;
 }
 
-void _WindowEndPaint(Window *window, Painter *painter) {
-	(void) painter;
+int _X11ErrorTrap(Display *display, XErrorEvent *event) {
+	(void) display;
+	(void) event;
+	global.x11Error = true;
+	return 0;
+}
 
-	XPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
-		window->updateRegion.l, window->updateRegion.t, window->updateRegion.l, window->updateRegion.t,
-		window->updateRegion.r - window->updateRegion.l, window->updateRegion.b - window->updateRegion.t);
+Bool _ShmCompletionPredicate(Display *display, XEvent *event, XPointer argument) {
+	(void) display;
+	return event->type == global.shmCompletionEvent 
+		&& ((XShmCompletionEvent *) event)->drawable == ((Window *) argument)->window;
 }
 
-int _WindowMessage(Element *element, Message message, int di, void *dp)
-{
-	(void) di;
-	(void) dp;
+// Block until the server has finished reading bits for every XShmPutImage we sent.
+// XIfEvent only removes the completion events, everything else stays queued for MessageLoop.
+void _WindowWaitForPresent(Window *window) {
+	while (window->shmPending) {
+		XEvent event;
+		XIfEvent(global.display, &event, _ShmCompletionPredicate, (XPointer) window);
+		window->shmPending--;
+	}
+}
 
-	if (message == MSG_LAYOUT && element->childCount)
-	{
-		ElementMove(element->children[0], element->bounds, false);
-		ElementRepaint(element, NULL);
+bool _WindowCreateSharedImage(Window *window) {
+	XImage *image = XShmCreateImage(global.display, global.visual, 24, ZPixmap, NULL, &window->shmInfo, window->stride, window->capacityHeight);
+	if (!image) return false;
+
+	// The rest of the library assumes rows are exactly stride pixels apart
+	if (image->bytes_per_line != window->stride * 4) {
+		XDestroyImage(image);
+		return false;
 	}
 
-	return 0;
+	window->shmInfo.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+
+	if (window->shmInfo.shmid == -1) {
+		XDestroyImage(image);
+		return false;
+	}
+
+	window->shmInfo.shmaddr = image->data = (char *) shmat(window->shmInfo.shmid, NULL, 0);
+	window->shmInfo.readOnly = False;
+
+	if (window->shmInfo.shmaddr == (char *) -1) {
+		shmctl(window->shmInfo.shmid, IPC_RMID, NULL);
+		window->shmInfo.shmaddr = NULL;
+		image->data = NULL;
+		XDestroyImage(image);
+		return false;
+	}
+
+	// Attaching fails asynchronously (e.g. BadAccess on a remote display), so sync and trap the error
+	global.x11Error = false;
+	XErrorHandler previousHandler = XSetErrorHandler(_X11ErrorTrap);
+	XShmAttach(global.display, &window->shmInfo);
+	XSync(global.display, False);
+	XSetErrorHandler(previousHandler);
+
+	// Mark the segment for removal now; it's freed once both we and the server have detached,
+	// so it can't leak even if we crash
+	shmctl(window->shmInfo.shmid, IPC_RMID, NULL);
+
+	if (global.x11Error) {
+		shmdt(window->shmInfo.shmaddr);
+		window->shmInfo.shmaddr = NULL;
+		image->data = NULL;
+		XDestroyImage(image);
+		return false;
+	}
+
+	window->image = image;
+	window->bits = (uint32_t *) image->data;
+	return true;
+}
+
+void _WindowDestroySharedImage(Window *window) {
+	_WindowWaitForPresent(window);
+	XShmDetach(global.display, &window->shmInfo);
+	XDestroyImage(window->image);
+	shmdt(window->shmInfo.shmaddr);
+	window->shmInfo.shmaddr = NULL;
+	window->image = NULL;
+	window->bits = NULL;
+}
+
+// (Re)allocate bits and image when the window has outgrown them, or they're mostly unused.
+// The image covers the whole capacity; only the part inside width and height is ever presented.
+void _WindowResizeBits(Window *window) {
+	int stride, capacityHeight;
+	if (!_FramebufferNeedsResize(window, &stride, &capacityHeight)) return;
+	window->bitsAllocationCount++;
+
+	if (window->useShm) {
+		if (window->shmInfo.shmaddr) {
+			_WindowDestroySharedImage(window);
+		} else if (window->image) {
+			// The placeholder image from WindowCreate doesn't own any data yet
+			window->image->data = NULL;
+			XDestroyImage(window->image);
+			window->image = NULL;
+		}
+
+		window->stride = stride;
+		window->capacityHeight = capacityHeight;
+
+		if (_WindowCreateSharedImage(window)) {
+			return;
+		}
+
+		// Fall back to XPutImage for the rest of this window's life
+		window->useShm = false;
+		window->image = XCreateImage(global.display, global.visual, 24, ZPixmap, 0, NULL, 10, 10, 32, 0);
+	}
+
+	_FramebufferFree(window->bits, (size_t) window->stride * window->capacityHeight * 4, window->bitsMapped);
+	window->bits = _FramebufferAllocate((size_t) stride * capacityHeight * 4, &window->bitsMapped);
+	window->stride = stride;
+	window->capacityHeight = capacityHeight;
+	window->image->width = stride;
+	window->image->height = capacityHeight;
+	window->image->bytes_per_line = stride * 4;
+	window->image->data = (char *) window->bits;
+}
+
+// Copy r from bits to the window. With MIT-SHM the server reads bits directly, so only the
+// last put of a frame asks for a completion event, which _WindowWaitForPresent waits on
+// before bits are touched again. (Completion events arrive in request order.)
+void _WindowPresent(Window *window, Rectangle r, bool last) {
+	if (window->shmInfo.shmaddr) {
+		XShmPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
+			r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t, last);
+		if (last) window->shmPending++;
+	} else {
+		XPutImage(global.display, window->window, DefaultGC(global.display, 0), window->image, 
+			r.l, r.t, r.l, r.t, r.r - r.l, r.b - r.t);
+	}
+}
+
+void _WindowBeginPaint(Window *window) {
+	_WindowWaitForPresent(window);
+}
+
+void _WindowEndPaint(Window *window, Painter *painter) {
+	(void) painter;
+
+	for (int i = 0; i < window->updateRegion.count; i++) {
+		_WindowPresent(window, window->updateRegion.rectangles[i], i == window->updateRegion.count - 1);
+	}
 }
 
 Window *WindowCreate(const char *cTitle, int width, int height) {
 	// Window *window = (Window *) calloc(1, sizeof(Window));
-	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, 0, _WindowMessage);
+	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, ELEMENT_PAINT_THREAD_SAFE, _WindowMessage);
 	window->e.window = window;
 	global.windowCount++;
-	global.windows = realloc(global.windows, sizeof(Window *) * global.windowCount);
+	global.windows = (Window **) realloc(global.windows, sizeof(Window *) * global.windowCount);
 	global.windows[global.windowCount - 1] = window;
 
 	XSetWindowAttributes attributes = {};
@@ -449,40 +4522,139 @@ Window *WindowCreate(const char *cTitle, int width, int height) {
 	XMapRaised(global.display, window->window);
 	XSetWMProtocols(global.display, window->window, &global.windowClosedID, 1);
 	window->image = XCreateImage(global.display, global.visual, 24, ZPixmap, 0, NULL, 10, 10, 32, 0);
+	window->useShm = global.shmAvailable;
 	return window;
 }
 
+void WindowDestroy(Window *window) {
+	if (window->shmInfo.shmaddr) {
+		_WindowDestroySharedImage(window);
+	} else {
+		// bits didn't come from malloc, so don't let XDestroyImage free them
+		window->image->data = NULL;
+		XDestroyImage(window->image);
+		_FramebufferFree(window->bits, (size_t) window->stride * window->capacityHeight * 4, window->bitsMapped);
+	}
+
+	XDestroyWindow(global.display, window->window);
+	_WindowDestroyElements(window);
+}
+
+// Arm the frame clock to go off at deadline (a _TimeNow() value), or disarm it for UINT64_MAX
+void _FrameClockArm(uint64_t deadline) {
+	struct itimerspec spec = {};
+
+	if (deadline != UINT64_MAX) {
+		uint64_t now = _TimeNow();
+		uint64_t wait = deadline > now ? deadline - now : 1;	// all zeroes would disarm it
+		spec.it_value.tv_sec = wait / 1000000000;
+		spec.it_value.tv_nsec = wait % 1000000000;
+	}
+
+	timerfd_settime(global.timerFD, 0, &spec, NULL);
+}
+
 int MessageLoop() {
 	_Update();
+	uint64_t deadline = _MessageLoopTick();
 
 	while (true) {
-		XEvent event;
-		XNextEvent(global.display, &event);
-
-		if (event.type == ClientMessage && (Atom) event.xclient.data.l[0] == global.windowClosedID) {
-			return 0;
-		} else if (event.type == Expose) {
-			Window *window = _FindWindow(event.xexpose.window);
-			if (!window) continue;
-			XPutImage(global.display, window->window, DefaultGC(global.display, 0), 
-					window->image, 0, 0, 0, 0, window->width, window->height);
-		}else if (event.type == ConfigureNotify) {
-			Window *window = _FindWindow(event.xconfigure.window);
-			if (!window) continue;
-
-			if (window->width != event.xconfigure.width || window->height != event.xconfigure.height) {
-				window->width = event.xconfigure.width;
-				window->height = event.xconfigure.height;
-				window->bits = (uint32_t *) realloc(window->bits, window->width * window->height * 4);
-				window->image->width = window->width;
-				window->image->height = window->height;
-				window->image->bytes_per_line = window->width * 4;
-				window->image->data = (char *) window->bits;
+		// Sleep until the X connection, the frame clock or MessageLoopPost has something for us.
+		// XPending also flushes our requests, and catches events Xlib has already read from the socket.
+		if (!XPending(global.display)) {
+			_FrameClockArm(deadline);
+
+			struct pollfd fds[3] = {
+				{ ConnectionNumber(global.display), POLLIN, 0 },
+				{ global.timerFD, POLLIN, 0 },
+				{ global.wakeFD, POLLIN, 0 },
+			};
+
+			poll(fds, 3, -1);
+
+			uint64_t count;
+			if ((fds[1].revents & POLLIN) && read(global.timerFD, &count, sizeof(count))) {}
+			if ((fds[2].revents & POLLIN) && read(global.wakeFD, &count, sizeof(count))) {}
+		}
+
+		// Handle everything already queued as one batch.
+		// An interactive resize queues dozens of ConfigureNotify and Expose events; only the
+		// latest size and the union of the exposed rectangles matter, so the batch is laid out,
+		// painted and presented once.
+		while (XPending(global.display)) {
+			XEvent event;
+			XNextEvent(global.display, &event);
+
+			if (event.type == ClientMessage && (Atom) event.xclient.data.l[0] == global.windowClosedID) {
+				_EventRecord(RECORDED_EVENT_CLOSE, _FindWindow(event.xclient.window), 0, 0, 0, 0);
+				EventRecordStop();
+				return 0;
+			} else if (event.type == Expose) {
+				Window *window = _FindWindow(event.xexpose.window);
+				if (!window) continue;
+				Rectangle r = RectangleMake(event.xexpose.x, event.xexpose.x + event.xexpose.width,
+					event.xexpose.y, event.xexpose.y + event.xexpose.height);
+				_EventRecord(RECORDED_EVENT_EXPOSE, window, r.l, r.r, r.t, r.b);
+				RegionAdd(&window->exposeRegion, r);
+			} else if (event.type == global.shmCompletionEvent) {
+				// Nobody was waiting for this one yet
+				Window *window = _FindWindow(((XShmCompletionEvent *) &event)->drawable);
+				if (window && window->shmPending) window->shmPending--;
+			} else if (event.type == ConfigureNotify) {
+				Window *window = _FindWindow(event.xconfigure.window);
+				if (!window) continue;
+				_EventRecord(RECORDED_EVENT_RESIZE, window, event.xconfigure.width, event.xconfigure.height, 0, 0);
+				window->pendingWidth = event.xconfigure.width;
+				window->pendingHeight = event.xconfigure.height;
+			}
+		}
+
+		_EventRecordBatch();
+
+		for (uintptr_t i = 0; i < global.windowCount; i++) {
+			Window *window = global.windows[i];
+
+			if (window->width != window->pendingWidth || window->height != window->pendingHeight) {
+				window->width = window->pendingWidth;
+				window->height = window->pendingHeight;
+				_WindowResizeBits(window);
 				window->e.bounds = RectangleMake(0, window->width, 0, window->height);
 				window->e.clip = RectangleMake(0, window->width, 0, window->height);
-				ElementMessage(&window->e, MSG_LAYOUT, 0, 0);
-				_Update();
+				_ElementSync(&window->e);
+				ElementRelayout(&window->e);
+
+				// The whole window is going to be repainted and presented
+				window->exposeRegion.count = 0;
+			}
+
+			// If the update runs now, it presents the exposed areas along with what it painted, once
+			for (int j = 0; j < window->exposeRegion.count; j++) {
+				RegionAdd(&window->presentRegion, window->exposeRegion.rectangles[j]);
+			}
+
+			window->exposeRegion.count = 0;
+		}
+
+		// Timers, posted messages, and the update if the frame rate allows
+		deadline = _MessageLoopTick();
+
+		// An update the frame rate deferred presents the exposed areas itself once it has painted;
+		// a resize or scroll waiting to be painted means the bits there aren't valid yet
+		for (uintptr_t i = 0; i < global.windowCount; i++) {
+			Window *window = global.windows[i];
+			Region *region = &window->presentRegion;
+
+			if (window->updateRegion.count || (window->e.flags & (ELEMENT_LAYOUT_DIRTY | ELEMENT_LAYOUT_DESCENDANT_DIRTY))) {
+				continue;
 			}
+
+			RegionClip(region, RectangleMake(0, window->width, 0, window->height));
+
+			for (int j = 0; j < region->count; j++) {
+				_WindowPresent(window, region->rectangles[j], j == region->count - 1);
+			}
+
+			region->count = 0;
 		}
 	}
 }
@@ -491,13 +4663,294 @@ void Initialise() {
 	global.display = XOpenDisplay(NULL);
 	global.visual = XDefaultVisual(global.display, 0);
 	global.windowClosedID = XInternAtom(global.display, "WM_DELETE_WINDOW", 0);
+
+	// MIT-SHM only works when the server shares our memory, i.e. a local display
+	global.shmAvailable = XShmQueryExtension(global.display);
+	global.shmCompletionEvent = global.shmAvailable ? XShmGetEventBase(global.display) + ShmCompletion : -1;
+
+	global.timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	global.wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	_DrawInitialise();
+}
+
+#endif
+
+#if OS_HEADLESS
+
+void HeadlessPostEvent(Window *window, HeadlessEventType type, int width, int height)
+{
+	global.eventCount++;
+	global.events = (HeadlessEvent *) realloc(global.events, sizeof(HeadlessEvent) * global.eventCount);
+	HeadlessEvent *event = &global.events[global.eventCount - 1];
+	event->type = type;
+	event->window = window;
+	event->width = width;
+	event->height = height;
+}
+
+bool HeadlessDumpPPM(Window *window, const char *path)
+{
+	FILE *f = fopen(path, "wb");
+	if (!f) return false;
+
+	fprintf(f, "P6\n%d %d\n255\n", window->width, window->height);
+
+	// bits are 0xRRGGBB in a uint32_t, PPM wants packed R, G, B bytes
+	uint8_t *row = (uint8_t *) malloc(window->width * 3 + 1);
+	bool ok = true;
+
+	for (int y = 0; y < window->height && ok; y++)
+	{
+		for (int x = 0; x < window->width; x++)
+		{
+			uint32_t pixel = window->bits[(ptrdiff_t) y * window->stride + x];
+			row[x * 3 + 0] = (uint8_t) (pixel >> 16);
+			row[x * 3 + 1] = (uint8_t) (pixel >> 8);
+			row[x * 3 + 2] = (uint8_t) (pixel >> 0);
+		}
+
+		ok = fwrite(row, 3, window->width, f) == (size_t) window->width;
+	}
+
+	free(row);
+	if (fclose(f)) ok = false;
+	return ok;
+}
+
+void _WindowBeginPaint(Window *window)
+{
+	(void) window;
+}
+
+void _WindowEndPaint(Window *window, Painter *painter)
+{
+	(void) painter;
+
+	// Nothing to copy to: window->bits is the final framebuffer. Just keep score.
+	window->frameCount++;
+	window->pixelsPresented += RegionArea(&window->updateRegion);
+}
+
+Window *WindowCreate(const char *cTitle, int width, int height)
+{
+	(void) cTitle;
+
+	Window *window = (Window *) ElementCreate(sizeof(Window), NULL, ELEMENT_PAINT_THREAD_SAFE, _WindowMessage);
+	window->e.window = window;
+	global.windowCount++;
+	global.windows = (Window **) realloc(global.windows, sizeof(Window *) * global.windowCount);
+	global.windows[global.windowCount - 1] = window;
+
+	// Like the Win32 backend posting WM_SIZE, the first layout happens in MessageLoop
+	HeadlessPostEvent(window, HEADLESS_EVENT_RESIZE, width, height);
+	return window;
+}
+
+void WindowDestroy(Window *window)
+{
+	// Drop any events still queued for it
+	size_t kept = 0;
+
+	for (uintptr_t i = 0; i < global.eventCount; i++)
+	{
+		if (global.events[i].window != window)
+		{
+			global.events[kept++] = global.events[i];
+		}
+	}
+
+	global.eventCount = kept;
+	_FramebufferFree(window->bits, (size_t) window->stride * window->capacityHeight * 4, window->bitsMapped);
+	_WindowDestroyElements(window);
+}
+
+int MessageLoop()
+{
+	_Update();
+
+	while (true)
+	{
+		// Handle everything queued as one batch, like the X11 backend: resizes only apply the
+		// latest size, and the batch is laid out and painted once. Events posted while
+		// handling it (e.g. by message handlers) are left for the next batch.
+		uintptr_t batchCount = global.eventCount;
+
+		for (uintptr_t i = 0; i < batchCount; i++)
+		{
+			HeadlessEvent event = global.events[i];
+			Window *window = event.window;
+
+			if (event.type == HEADLESS_EVENT_CLOSE)
+			{
+				_EventRecord(RECORDED_EVENT_CLOSE, window, 0, 0, 0, 0);
+				EventRecordStop();
+				global.eventCount = 0;
+				return 0;
+			}
+			else if (event.type == HEADLESS_EVENT_EXPOSE)
+			{
+				_EventRecord(RECORDED_EVENT_EXPOSE, window, 0, window->width, 0, window->height);
+				ElementRepaint(&window->e, NULL);
+			}
+			else if (event.type == HEADLESS_EVENT_RESIZE)
+			{
+				_EventRecord(RECORDED_EVENT_RESIZE, window, event.width, event.height, 0, 0);
+				window->pendingWidth = event.width;
+				window->pendingHeight = event.height;
+			}
+		}
+
+		_EventRecordBatch();
+
+		global.eventCount -= batchCount;
+		memmove(global.events, global.events + batchCount, sizeof(HeadlessEvent) * global.eventCount);
+
+		for (uintptr_t i = 0; i < global.windowCount; i++)
+		{
+			Window *window = global.windows[i];
+
+			if (window->width != window->pendingWidth || window->height != window->pendingHeight)
+			{
+				window->width = window->pendingWidth;
+				window->height = window->pendingHeight;
+				_WindowReserveBits(window);
+				window->e.bounds = RectangleMake(0, window->width, 0, window->height);
+				window->e.clip = RectangleMake(0, window->width, 0, window->height);
+				_ElementSync(&window->e);
+				ElementRelayout(&window->e);
+			}
+		}
+
+		// Timers that are due now, posted messages, and the update if the frame rate allows
+		_MessageLoopTick();
+
+		if (!global.eventCount && !_MessageLoopHasPosted())
+		{
+			break;
+		}
+	}
+
+	// There's nothing to wait for without a display server, so don't leave
+	// an update waiting for the frame rate limit
+	if (_UpdatePending())
+	{
+		_Update();
+	}
+
+	return 0;
+}
+
+// Sum the windows' running totals, for HeadlessReplay to take the difference before and after each batch
+ReplayFrame _ReplayTotals()
+{
+	ReplayFrame totals = {};
+
+	for (uintptr_t i = 0; i < global.windowCount; i++)
+	{
+		totals.layoutTime += global.windows[i]->layoutTimeTotal;
+		totals.paintTime += global.windows[i]->paintTimeTotal;
+		totals.presentTime += global.windows[i]->presentTimeTotal;
+		totals.pixelsPainted += global.windows[i]->pixelsPainted;
+	}
+
+	return totals;
+}
+
+ReplayFrame *HeadlessReplay(const char *path, size_t *frameCount)
+{
+	*frameCount = 0;
+	FILE *f = fopen(path, "rb");
+	uint32_t magic = 0;
+
+	if (!f || fread(&magic, sizeof(magic), 1, f) != 1 || magic != EVENT_RECORD_MAGIC)
+	{
+		if (f) fclose(f);
+		return NULL;
+	}
+
+	ReplayFrame *frames = NULL, frame = {};
+	size_t frameCapacity = 0;
+	uint64_t time = 0;
+	bool closed = false;
+
+	while (!closed)
+	{
+		RecordedEvent event;
+		bool ended = fread(&event, sizeof(event), 1, f) != 1;
+
+		if (!ended)
+		{
+			time += (uint64_t) event.delay * 1000;
+			Window *window = event.window < global.windowCount ? global.windows[event.window] : NULL;
+
+			if (event.type == RECORDED_EVENT_RESIZE && window)
+			{
+				HeadlessPostEvent(window, HEADLESS_EVENT_RESIZE, event.values[0], event.values[1]);
+				frame.eventCount++;
+			}
+			else if (event.type == RECORDED_EVENT_EXPOSE && window)
+			{
+				// There's no partial expose without a display server; the whole window is repainted
+				HeadlessPostEvent(window, HEADLESS_EVENT_EXPOSE, 0, 0);
+				frame.eventCount++;
+			}
+			else if (event.type == RECORDED_EVENT_CLOSE)
+			{
+				// The loop returned without updating, so nothing else in the batch counts
+				global.eventCount = 0;
+				frame.eventCount = 0;
+				closed = true;
+			}
+
+			if (event.type != RECORDED_EVENT_BATCH)
+			{
+				continue;
+			}
+		}
+
+		// Handle the batch, or what's left of a recording that was cut off
+		if (frame.eventCount)
+		{
+			ReplayFrame before = _ReplayTotals();
+			MessageLoop();
+			ReplayFrame after = _ReplayTotals();
+			frame.time = time;
+			frame.layoutTime = after.layoutTime - before.layoutTime;
+			frame.paintTime = after.paintTime - before.paintTime;
+			frame.presentTime = after.presentTime - before.presentTime;
+			frame.pixelsPainted = after.pixelsPainted - before.pixelsPainted;
+
+			if (*frameCount == frameCapacity)
+			{
+				frameCapacity = frameCapacity ? frameCapacity * 2 : 64;
+				frames = (ReplayFrame *) realloc(frames, sizeof(ReplayFrame) * frameCapacity);
+			}
+
+			frames[(*frameCount)++] = frame;
+			frame = {};
+		}
+
+		if (ended)
+		{
+			break;
+		}
+	}
+
+	fclose(f);
+	return frames ? frames : (ReplayFrame *) calloc(1, sizeof(ReplayFrame));
+}
+
+void Initialise()
+{
+	_DrawInitialise();
 }
 
 #endif
 
 ////////////////////////////////////
 //- Test Usage Code
-#include <stdio.h>
+#if BUILD_EXAMPLE
 
 Element *elementA, *elementB, *elementC, *elementD;	// A is pink rect covering entire screen, B is grey rect centred mid, C is blue, D is green
 
@@ -563,12 +5016,21 @@ int ElementDMessage(Element *element, Message message, int di, void *dp) {
 int main() {
 	Initialise();
 	Window *window = WindowCreate("Hello, world", 300, 200);
-	elementA = ElementCreate(sizeof(Element), &window->e, 0, ElementAMessage);
-	elementB = ElementCreate(sizeof(Element), elementA, 0, ElementBMessage);
-	elementC = ElementCreate(sizeof(Element), elementB, 0, ElementCMessage);
-	elementD = ElementCreate(sizeof(Element), elementB, 0, ElementDMessage);
+	elementA = ElementCreate(sizeof(Element), &window->e, ELEMENT_PAINT_THREAD_SAFE | ELEMENT_OPAQUE, ElementAMessage);
+	elementB = ElementCreate(sizeof(Element), elementA, ELEMENT_PAINT_THREAD_SAFE | ELEMENT_OPAQUE, ElementBMessage);
+	elementC = ElementCreate(sizeof(Element), elementB, ELEMENT_PAINT_THREAD_SAFE | ELEMENT_OPAQUE, ElementCMessage);
+	elementD = ElementCreate(sizeof(Element), elementB, ELEMENT_PAINT_THREAD_SAFE | ELEMENT_OPAQUE, ElementDMessage);
+
+#if OS_HEADLESS
+	int result = MessageLoop();
+	HeadlessDumpPPM(window, "main.ppm");
+	return result;
+#else
 	return MessageLoop();
+#endif
 }
 
+#endif
+
 // Add rendering.
 
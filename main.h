@@ -4,6 +4,21 @@
 #include <stddef.h>
 #include <cstring>
 #include <cstdlib>
+#include <stdio.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#if ARCH_X64
+#include <immintrin.h>
+#if COMPILER_MSVC
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
 
 #if OS_WINDOWS
 #define Rectangle W32Rectangle
@@ -13,11 +28,24 @@
 
 #if OS_LINUX
 #define Window X11Window
+#define Region X11Region
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/cursorfont.h>
+#include <X11/extensions/XShm.h>
 #undef Window
+#undef Region
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__linux__)
+#include <sys/mman.h>
 #endif
 
 
@@ -30,6 +58,10 @@ enum Message
 	//------------------
 	MSG_PAINT,			// dp = pointer to Painter
 	MSG_LAYOUT,
+	MSG_DESTROY,		// sent just before the element's memory is freed; release anything it owns
+	MSG_TIMER,			// di = id returned by TimerCreate
+	MSG_GET_WIDTH,		// di = height the element will be given, or 0 if not known yet; return the preferred width
+	MSG_GET_HEIGHT,		// di = width the element will be given, or 0 if not known yet; return the preferred height
 	//------------------
 
 	// User Messages
@@ -43,11 +75,86 @@ struct Rectangle
 	int l, r, t, b;
 };
 
+// A set of disjoint rectangles, e.g. the parts of a window that need repainting.
+// Rectangles close enough together are merged, so the count stays small and the
+// wasted area (pixels covered but never added) stays bounded.
+#define REGION_MAX_RECTANGLES (8)
+
+struct Region
+{
+	Rectangle rectangles[REGION_MAX_RECTANGLES];	// disjoint and non-empty
+	int count;
+};
+
 struct Painter
 {
 	Rectangle clip;		// The rectangle the element should draw into
-	uint32_t *bits;		// The bitmap itself. bits[y * painter->width + x] gives the RGB value of pixel (x, y).
+	uint32_t *bits;		// The bitmap itself. bits[y * painter->stride + x] gives the RGB value of pixel (x, y).
 	int width, height;	// width and height of bitmap
+	int stride;			// pixels from the start of one row to the next; at least width
+	struct DisplayList *recording;	// If set, the Draw functions append commands to this instead of drawing
+	struct OcclusionList *occlusion;	// (Framework) opaque elements painted later in this pass, whose area others can skip
+	struct PaintStack *stack;		// (Framework) scratch stack for the paint walk; one per thread painting
+	uint64_t pixelsPainted;			// Pixels written by the Draw functions with this painter
+	uint64_t paintsCulled;			// MSG_PAINTs skipped because the element was completely covered
+	uint64_t elementsVisited;		// Elements the paint walk reached inside the clip
+	uint32_t depthMax;				// Deepest level below the walk's first element that it reached
+};
+
+// The paint walks keep the elements still to visit on a stack instead of recursing, so deep trees
+// can't overflow the thread's stack. Children are pushed last first, so they come off in the same
+// order recursion would visit them; the occlusion numbering depends on that.
+struct PaintStackEntry
+{
+	struct Element *element;
+	Rectangle clip;			// the parent's clip, within the area being painted
+	uint32_t depth;
+};
+
+struct PaintStack
+{
+	PaintStackEntry *entries;
+	uint32_t count, capacity;	// kept between walks, so painting doesn't allocate once it's grown
+};
+
+// Opaque elements found in the area being painted, in paint order
+struct Occluder
+{
+	Rectangle rectangle;	// the element's clip, within the area being painted
+	uint32_t order;			// position in the paint walk
+};
+
+struct OcclusionList
+{
+	Occluder *occluders;
+	uint32_t count, capacity;
+	uint32_t order;			// position of the next element in the paint walk
+	uint32_t first;			// first occluder painted after the current element
+};
+
+#define PAINT_MAX_FRAGMENTS (16)	// At most this many pieces are left of an element's clip after subtracting occluders
+
+// Draw commands recorded from an ELEMENT_RETAINED element's MSG_PAINT, replayed on later repaints.
+// Each command is a DisplayCommand header followed by its parameters.
+enum DisplayCommandType
+{
+	DISPLAY_COMMAND_BLOCK,	// Rectangle, uint32_t colour
+	DISPLAY_COMMAND_STRING,	// Rectangle bounds, uint32_t colour, int size, int align, then the string's bytes
+	DISPLAY_COMMAND_BLOCK_BLEND,	// Rectangle, uint32_t colour
+	DISPLAY_COMMAND_GRADIENT,	// Rectangle, uint32_t from, uint32_t to, int vertical
+};
+
+struct DisplayCommand
+{
+	uint16_t type;		// DisplayCommandType
+	uint16_t bytes;		// including this header
+};
+
+struct DisplayList
+{
+	uint8_t *data;
+	size_t bytes, capacity;
+	bool valid;			// cleared when the element repaints itself or moves
 };
 
 // element is the specific element that's receiving the message, making it possible
@@ -75,25 +182,159 @@ struct Painter
 typedef int (*MessageHandler)(struct Element *element, Message message, int di, void *dp);
 
 
+// Common element flags (the higher order 16 bits of Element::flags)
+#define ELEMENT_PAINT_THREAD_SAFE (1 << 16)	// MSG_PAINT may be sent from several threads at once, each with its own Painter.
+#define ELEMENT_SPATIAL_INDEX (1 << 17)		// Keep a grid of the children's clips, for containers with many (absolutely positioned) children.
+#define ELEMENT_LAYOUT_DIRTY (1 << 18)		// (Set by the framework) MSG_LAYOUT will be sent in the next layout pass.
+#define ELEMENT_LAYOUT_DESCENDANT_DIRTY (1 << 19)	// (Set by the framework) Some descendant has ELEMENT_LAYOUT_DIRTY.
+#define ELEMENT_RETAINED (1 << 20)			// Record MSG_PAINT once and replay it until the element calls ElementRepaint on itself or is moved. Only for elements that draw exclusively with the Draw functions.
+#define ELEMENT_OPAQUE (1 << 21)			// MSG_PAINT covers every pixel of the element's bounds with opaque colour, so elements underneath needn't paint there.
+#define ELEMENT_LAYER (1 << 22)				// Cache the subtree in its own bitmap, repainted only when something inside it is invalidated. MSG_PAINT must cover the element's bounds (like ELEMENT_OPAQUE).
+#define ELEMENT_H_FILL (1 << 23)			// In a box, take a share of the width the other children leave over (in a row or grid) instead of the preferred width.
+#define ELEMENT_V_FILL (1 << 24)			// In a box, take a share of the height the other children leave over (in a column or grid) instead of the preferred height.
+#define ELEMENT_WIDTH_CACHED (1 << 25)		// (Set by the framework) measuredSize[0] is the answer to MSG_GET_WIDTH with di = measuredFor[0].
+#define ELEMENT_HEIGHT_CACHED (1 << 26)		// (Set by the framework) measuredSize[1] is the answer to MSG_GET_HEIGHT with di = measuredFor[1].
+
+// Uniform grid over a container's clip. Each cell lists the indices of the children whose
+// clip overlaps it. Kept up to date by ElementMove; rebuilt when indices shift or the
+// container's clip changes.
+#define SPATIAL_CELL_SIZE (128)
+
+struct SpatialCell
+{
+	uint32_t *children;		// indices into the container's children array
+	uint32_t count, capacity;
+};
+
+struct SpatialIndex
+{
+	Rectangle bounds;		// the container's clip when the grid was built
+	int columns, rows;
+	SpatialCell *cells;
+	bool dirty;				// needs rebuilding before the next query
+};
+
+// Index of an element in its window's ElementStore. Handles of destroyed elements are reused.
+typedef uint32_t ElementHandle;
+#define ELEMENT_HANDLE_NONE (0xFFFFFFFF)
+
 struct Element
 {
 	uint32_t flags;			// First 16 bits are specific to the type of element (button, label, etc.). The higher order 16 bits are common to all elements.
 	uint32_t childCount;	// The number of child elements
+	uint32_t childCapacity;	// The number of pointers children has room for; grows geometrically
 	Rectangle bounds, clip;	// bounds indicate where the element exists in the window. clip stores the subrectangle of the element's bounds that is actually visibile and interactable.
 	Element *parent;
 	Element **children;
 	struct Window *window;	// Window at the root of the heirarchy
 	void *cp;				// Context pointer (for the user of the library)
 	MessageHandler messageClass, messageUser;	// messageClass: class handler, default behaviour; messageUser: optional override
+	SpatialIndex *spatialIndex;	// Only for ELEMENT_SPATIAL_INDEX; created on first use
+	struct DisplayList *displayList;	// Only for ELEMENT_RETAINED; created on first paint
+	struct Layer *layer;				// Only for ELEMENT_LAYER; created on first paint
+	ElementHandle handle;				// (Framework) where the element's copy of clip and flags lives in the window's store
+	ElementHandle *childHandles;		// (Framework) the children's handles, in the same order as children; same capacity
+	int measuredSize[2], measuredFor[2];	// (Framework) the last preferred width and height, and the di they were measured with
+};
+
+// The data the tree walks look at most, for every element of a window, kept in parallel arrays indexed by
+// handle (structure of arrays). Walks over many children read these contiguous arrays and only touch the
+// Element structures they actually visit. The Element fields stay the way to read the data; the framework
+// writes both whenever it changes them. Flags set by the user after ElementCreate may be stale in the store,
+// so the walks only read the framework's own bits from it (ELEMENT_LAYOUT_DIRTY and ELEMENT_LAYOUT_DESCENDANT_DIRTY).
+struct ElementStore
+{
+	Rectangle *clips;
+	uint32_t *flags;
+	Element **elements;			// NULL for free handles
+	uint32_t count, capacity;	// handles below count have been given out
+	ElementHandle *freeHandles;	// destroyed elements' handles, to be given out again
+	uint32_t freeCount, freeCapacity;
+};
+
+// Per-window allocator that all elements of the window are carved from. Blocks are
+// rounded up to a size class; freed blocks go on that class's free list for reuse,
+// and all memory is returned at once when the window is destroyed. Blocks too big for a
+// size class get a chunk of their own, which is freed as soon as the block is.
+#define ARENA_CHUNK_BYTES (64 * 1024)
+#define ARENA_SIZE_CLASS_BYTES (16)		// size class granularity, and the alignment of every block
+#define ARENA_SIZE_CLASSES (64)			// blocks bigger than this many classes get a chunk to themselves
+
+struct Arena
+{
+	struct ArenaChunk *chunks;				// newest first; blocks are carved from the first one
+	struct ArenaChunk *dedicated;			// chunks holding a single big block each
+	void *freeLists[ARENA_SIZE_CLASSES];	// freed blocks, by size class
+	size_t bytesReserved;					// total size of all chunks
+	size_t bytesLive;						// allocated and not yet freed, including block headers
+	size_t bytesPeak;						// highest bytesLive has been
+};
+
+// Offscreen bitmap caching an ELEMENT_LAYER subtree. It covers the element's clip, and is
+// composited into the window by copying rows. All layers share a memory budget; when it's
+// exceeded the least recently used layers lose their bitmaps and are repainted next time.
+#define LAYER_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+struct Layer
+{
+	uint32_t *bits;			// NULL if evicted (or not painted yet)
+	Rectangle bounds;		// window coordinates covered by bits; the element's clip when allocated
+	Region dirty;			// parts of bounds that need repainting before the next composite
+	uint64_t lastUsed;		// value of global.layerFrame when last composited
+	Layer *previous, *next;	// in global.layers, most recently used first; only while bits is allocated
+};
+
+// Window bitmaps are allocated with headroom so that resizing doesn't reallocate every time.
+// Growing past the capacity adds FRAMEBUFFER_GROWTH_PERCENT in each direction; shrinking keeps
+// the bitmap until it's less than 1 / FRAMEBUFFER_SHRINK_FACTOR used. Rows are padded to a multiple
+// of FRAMEBUFFER_ALIGN_PIXELS. On Linux, bitmaps of at least FRAMEBUFFER_HUGE_PAGE_BYTES are
+// mapped directly and marked for transparent huge pages, to save TLB misses when painting.
+#define FRAMEBUFFER_GROWTH_PERCENT (25)
+#define FRAMEBUFFER_SHRINK_FACTOR (4)
+#define FRAMEBUFFER_ALIGN_PIXELS (16)
+#define FRAMEBUFFER_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+// One level of the layout pass's path: an element, and the next of its children to check
+struct LayoutFrame
+{
+	Element *element;
+	uint32_t next;
 };
 
 struct Window
 {
 	Element e;
+	Arena arena;		// every element in the window except e itself
+	ElementStore store;	// every element in the window, including e (handle 0)
 	uint32_t *bits;		// The bitmap image of the window's content
 	int width, height;	// drawable size
-	Rectangle updateRegion;
+	int stride;			// pixels from the start of one row of bits to the next; at least width
+	int capacityHeight;	// rows allocated in bits; at least height
+	uint64_t bitsAllocationCount;	// times bits has been (re)allocated
+	bool bitsMapped;				// bits came from mmap rather than malloc
+	Region updateRegion;	// everything marked for repaint since the last _Update
+	Region presentRegion;	// pixels changed in bits without being painted (by ElementScroll), to be presented with the next update
+	uint64_t layoutCount;			// MSG_LAYOUT messages sent by the layout pass
+	uint64_t layoutSkippedCount;	// ElementRelayout requests for elements that were already waiting for layout
+	uint64_t measureCount;			// MSG_GET_WIDTH and MSG_GET_HEIGHT messages sent; other measurements came from the cache
+	uint64_t pixelsUpdated;			// total area of all update regions painted
+	uint64_t pixelsPainted;			// pixels written by the Draw functions; pixelsPainted / pixelsUpdated is the overdraw ratio
+	uint64_t paintsCulled;			// MSG_PAINTs skipped because ELEMENT_OPAQUE elements covered the element
+	uint32_t opaqueCount;			// elements with ELEMENT_OPAQUE; painting only looks for occluders when there are some
+	uint64_t pixelsScrolled;		// pixels moved by ElementScroll instead of being repainted
+	uint64_t paintVisits;			// elements the paint walks reached inside the area being painted
+	uint64_t layoutVisits;			// elements the layout pass went through, dirty or on the path to one
+	uint32_t paintDepthMax;			// deepest level the paint walks have reached
+	uint32_t layoutDepthMax;		// deepest level the layout pass has reached
+	uint64_t paintTime;				// nanoseconds spent painting in the last update that repainted the window
+	uint64_t frameTime;				// nanoseconds from the start of that update until the window was presented
+	uint64_t layoutTimeTotal;		// nanoseconds spent in each step of all updates
+	uint64_t paintTimeTotal;
+	uint64_t presentTimeTotal;
 
+	PaintStack paintStack;			// for the paint walks on the thread updating the window, including layer repaints
+	struct LayoutFrame *layoutStack;	// the path from e to the element the layout pass is visiting
+	uint32_t layoutStackCapacity;
 
 #if OS_WINDOWS
 	HWND hwnd;
@@ -103,8 +344,192 @@ struct Window
 #if OS_LINUX
 	X11Window window;
 	XImage *image;
+	bool useShm;				// bits live in a shared memory segment attached to the server (MIT-SHM)
+	XShmSegmentInfo shmInfo;	// valid when shmInfo.shmaddr is non-NULL
+	int shmPending;				// XShmPutImage requests the server may still be reading bits for
+	int pendingWidth, pendingHeight;	// latest size from ConfigureNotify, applied once per batch of events
+	Region exposeRegion;		// union of the Expose rectangles in the current batch of events
+#endif
+
+#if OS_HEADLESS
+	uint64_t frameCount;		// number of times _WindowEndPaint has presented this window
+	uint64_t pixelsPresented;	// total area of all presented rectangles
+	int pendingWidth, pendingHeight;	// latest size from HEADLESS_EVENT_RESIZE, applied once per batch of events
+#endif
+
+};
+
+#if OS_HEADLESS
+// Events injected into the headless backend, processed in order by MessageLoop
+enum HeadlessEventType
+{
+	HEADLESS_EVENT_RESIZE,	// width, height = new client size
+	HEADLESS_EVENT_EXPOSE,	// repaint the whole window, as if the OS had lost its contents
+	HEADLESS_EVENT_CLOSE,	// makes MessageLoop return
+};
+
+struct HeadlessEvent
+{
+	HeadlessEventType type;
+	Window *window;
+	int width, height;
+};
+#endif
+
+// Row fill and blend implementations used by the Draw functions. The fastest one the CPU supports is picked by Initialise.
+// FILL_KERNEL_AVX512 needs AVX-512F and AVX-512BW.
+enum FillKernel
+{
+	FILL_KERNEL_SCALAR,
+	FILL_KERNEL_SSE2,
+	FILL_KERNEL_AVX2,
+	FILL_KERNEL_AVX512,
+	FILL_KERNEL_COUNT,
+};
+
+// Fill count pixels starting at row. stream = use non-temporal stores (bypass the cache).
+typedef void (*FillRowFunction)(uint32_t *row, int count, uint32_t colour, bool stream);
+
+// Blend count pixels of colour into row, weighted by alpha (0 = keep the pixel, 255 = replace it with colour)
+typedef void (*BlendMaskRowFunction)(uint32_t *row, const uint8_t *alpha, int count, uint32_t colour);
+// Blend the premultiplied colour over count pixels starting at row
+typedef void (*BlendRowFunction)(uint32_t *row, int count, uint32_t colour);
+// Blend count premultiplied pixels from source over the pixels starting at row
+typedef void (*BlendSpanFunction)(uint32_t *row, const uint32_t *source, int count);
+
+// The scalar kernels, which work everywhere, so drawing works even before Initialise picks the fastest ones
+void _FillRowScalar(uint32_t *row, int count, uint32_t colour, bool stream);
+void _BlendMaskRowScalar(uint32_t *row, const uint8_t *alpha, int count, uint32_t colour);
+void _BlendRowScalar(uint32_t *row, int count, uint32_t colour);
+void _BlendSpanScalar(uint32_t *row, const uint32_t *source, int count);
+
+// Text is drawn with a built-in 8x8 bitmap font covering printable ASCII, scaled to the requested size
+// (in pixels; each character is a size x size cell). Each glyph is rasterized with anti-aliasing the first
+// time it's used at a size, into an 8-bit alpha atlas made of fixed pages that are never moved or freed.
+#define GLYPH_FIRST_CHARACTER (32)
+#define GLYPH_CHARACTER_COUNT (95)	// ' ' to '~'; anything else is drawn as '?'
+#define GLYPH_MAX_SIZE (256)
+#define GLYPH_ATLAS_PAGE_SIZE (512)	// width and height of each atlas page, in pixels
+
+#define TEXT_ALIGN_LEFT (0)
+#define TEXT_ALIGN_CENTER (1)
+#define TEXT_ALIGN_RIGHT (2)
+
+struct Glyph
+{
+	uint8_t *alpha;			// top-left of the glyph in its atlas page; rows are GLYPH_ATLAS_PAGE_SIZE bytes apart. NULL if blank.
+	int16_t x, y;			// offset of the alpha from the top-left of the character's cell
+	int16_t width, height;	// size of the alpha, trimmed to the non-blank pixels
+	bool ready;				// rasterized
+};
+
+struct GlyphAtlasPage
+{
+	uint8_t *alpha;			// GLYPH_ATLAS_PAGE_SIZE * GLYPH_ATLAS_PAGE_SIZE
+	int shelfX, shelfY, shelfHeight;	// glyphs are packed left to right in shelves, top to bottom
+};
+
+// A string laid out at a size, so drawing it again doesn't need to decode it or look up its glyphs.
+// Runs are cached by the string's content, TEXT_RUN_CACHE_SLOTS of them at a time. The hash picks a set of
+// TEXT_RUN_CACHE_WAYS slots; a new run replaces the least recently used run in its set.
+#define TEXT_RUN_CACHE_SLOTS (4096)
+#define TEXT_RUN_CACHE_WAYS (8)
+
+struct TextRunGlyph
+{
+	Glyph *glyph;
+	int x;					// left edge of the character's cell, from the start of the run
+};
+
+struct TextRun
+{
+	char *string;
+	size_t bytes;
+	uint64_t hash;
+	int size;
+	int width;				// in pixels, including blank characters
+	TextRunGlyph *glyphs;	// only the characters that aren't blank
+	uint32_t glyphCount;
+	uint64_t lastUsed;		// value of global.updateCount when last drawn or measured
+};
+
+// A container that places its children from their preferred sizes (see ElementGetWidth), so they don't need
+// their own MSG_LAYOUT code. Children get their preferred size along the box's direction and all of its size
+// across it, except that children with ELEMENT_H_FILL / ELEMENT_V_FILL share the space the others leave over.
+// The lower 16 bits of the box's flags choose the arrangement:
+#define BOX_COLUMN (0)			// children one above another, top to bottom
+#define BOX_ROW (1 << 0)		// children side by side, left to right
+#define BOX_GRID (1 << 1)		// children fill rows of columns cells, left to right, then top to bottom. Each column is as wide
+								// as its widest child and each row as tall as its tallest; columns (rows) with a H_FILL (V_FILL) child share the rest.
+
+struct BoxColumn
+{
+	int width;
+	bool fill;
+};
+
+struct Box
+{
+	Element e;
+	Rectangle padding;		// space left inside each edge
+	int gap;				// space between neighbouring children (or grid rows and columns)
+	int columns;			// BOX_GRID only; at least 1
+	BoxColumn *gridColumns;	// (Framework) the column widths, worked out for each measurement and layout
+	int gridColumnCapacity;
+};
+
+#if ENABLE_TRACING
+// The trace is a ring buffer: once it's full, new events overwrite the oldest ones
+#define TRACE_BUFFER_EVENTS (1 << 16)	// must be a power of 2
+
+struct TraceEvent
+{
+	const char *name;		// a string literal
+	const void *element;	// the element or window the event is about, or NULL
+	uint64_t start;			// _TimeNow() nanoseconds
+	uint64_t duration;
+	uint64_t pixels;		// pixels written by the Draw functions during the event
+	uint32_t thread;		// small number identifying the thread, starting at 1
+};
 #endif
 
+// Sends MSG_TIMER to element once deadline passes (see TimerCreate)
+struct Timer
+{
+	Element *element;
+	uint64_t interval;	// nanoseconds
+	uint64_t deadline;	// _TimeNow() value at which it next fires
+	uint32_t id;
+	bool repeat;
+};
+
+// A recording from EventRecordStart is EVENT_RECORD_MAGIC followed by one RecordedEvent for each platform
+// event MessageLoop handled, in order, in the machine's byte order
+#define EVENT_RECORD_MAGIC (0x31564555)	// "UEV1"
+
+enum RecordedEventType
+{
+	RECORDED_EVENT_RESIZE,	// values = width, height
+	RECORDED_EVENT_EXPOSE,	// values = l, r, t, b of the area the platform asked for
+	RECORDED_EVENT_CLOSE,
+	RECORDED_EVENT_BATCH,	// the events since the last one were handled together, then the loop updated
+};
+
+struct RecordedEvent
+{
+	uint32_t delay;			// microseconds since the previous event
+	uint16_t type;			// RecordedEventType
+	uint16_t window;		// index in global.windows
+	int16_t values[4];
+};
+
+// A message waiting to be delivered by the message loop (see MessageLoopPost)
+struct PostedMessage
+{
+	Element *element;
+	Message message;
+	int di;
+	void *dp;
 };
 
 struct GlobalState
@@ -112,10 +537,74 @@ struct GlobalState
 	Window **windows;
 	size_t windowCount;	// number of open windows; number of pointers in the windows array above.
 
+	FillKernel fillKernel;
+	FillRowFunction fillRow = _FillRowScalar;
+	BlendMaskRowFunction blendMaskRow = _BlendMaskRowScalar;	// picked along with fillRow, using the same instruction set
+	BlendRowFunction blendRow = _BlendRowScalar;
+	BlendSpanFunction blendSpan = _BlendSpanScalar;
+
+	std::mutex textMutex;			// protects the glyphs and run cache, since thread safe elements draw text from paint threads
+	Glyph *glyphSizes[GLYPH_MAX_SIZE + 1];	// GLYPH_CHARACTER_COUNT glyphs for each size, allocated when the size is first used
+	GlyphAtlasPage *glyphPages;		// the last one is being filled
+	size_t glyphPageCount;
+	TextRun *textRuns[TEXT_RUN_CACHE_SLOTS];	// in sets of TEXT_RUN_CACHE_WAYS, indexed by hash
+	uint64_t textRunHits, textRunMisses;
+
+	struct ThreadPool *paintPool;	// NULL unless tiled painting was enabled with PaintSetThreadCount
+	struct PaintTile *tiles;		// scratch array of tiles for the window being painted
+	size_t tileCapacity;
+	PaintStack *tileStacks;			// one per paintPool thread, for the walks painting tiles
+	struct ThreadPool *updatePool;	// NULL unless painting windows at the same time was enabled with UpdateSetThreadCount
+	Window **updateWindows;			// scratch array of the windows _Update paints on updatePool
+	size_t updateWindowCapacity;
+	std::mutex presentMutex;		// held by the updatePool threads around _WindowEndPaint
+
+	Layer *layers, *layersLast;		// LRU list of layers with bitmaps
+	size_t layerBytes;				// total size of all layer bitmaps
+	size_t layerBudget;				// evict layers to keep layerBytes under this; LAYER_DEFAULT_BUDGET unless changed
+	uint64_t layerEvictionCount;
+	uint64_t layerFrame;			// incremented by every _Update; layers used in the current frame aren't evicted
+	size_t layerCount;				// number of elements with a Layer; when 0, invalidation doesn't look for layers
+
+	Timer *timers;					// in no particular order
+	size_t timerCount, timerCapacity;
+	uint32_t timerLastID;
+	uint64_t frameInterval;			// minimum time between updates in nanoseconds; 0 for no limit
+	uint64_t lastUpdateTime;		// _TimeNow() at the start of the last _Update
+	uint64_t updateCount;			// number of times _Update has run
+
+#if ENABLE_TRACING
+	TraceEvent traceEvents[TRACE_BUFFER_EVENTS];
+	std::atomic<uint64_t> traceEventCount;	// total ever recorded; the next event goes in traceEvents[traceEventCount % TRACE_BUFFER_EVENTS]
+	std::atomic<uint32_t> traceThreadCount;
+#endif
+
+	FILE *eventRecording;			// NULL unless EventRecordStart was called
+	uint64_t eventRecordTime;		// _TimeNow() when the last event was written
+	bool eventRecordBatchOpen;		// events have been written since the last RECORDED_EVENT_BATCH
+
+	std::mutex postedMutex;			// protects the posted messages, which any thread can add to
+	PostedMessage *posted;
+	size_t postedCount, postedCapacity;
+
 #if OS_LINUX
 	Display *display;
 	Visual *visual;
 	Atom windowClosedID;
+	bool shmAvailable;			// the server supports MIT-SHM and we're on the same machine
+	int shmCompletionEvent;		// event type of XShmCompletionEvent, or -1
+	bool x11Error;				// set by _X11ErrorTrap
+	int timerFD;				// frame clock: armed for the next timer or frame the loop is waiting for
+	int wakeFD;					// eventfd written by MessageLoopPost to wake the loop up
+#endif
+
+#if OS_WINDOWS
+	HANDLE wakeEvent;			// set by MessageLoopPost to wake the loop up
+#endif
+
+#if OS_HEADLESS
+	HeadlessEvent *events;	// pending events, oldest first
+	size_t eventCount;
 #endif
 };
 
@@ -124,25 +613,153 @@ struct GlobalState
 void Initialise();
 int MessageLoop();
 Window *WindowCreate(const char *cTitle, int width, int height);
+void WindowDestroy(Window *window);		// Close the window and free it along with all of its elements
+
+#if OS_HEADLESS
+// There is no display server, so events are posted by the program itself.
+// MessageLoop processes everything that was posted, then returns 0 once the queue is empty.
+void HeadlessPostEvent(Window *window, HeadlessEventType type, int width, int height);
+bool HeadlessDumpPPM(Window *window, const char *path);	// write window->bits as a binary PPM (P6); false on I/O error
+
+// One recorded batch of events, fed through MessageLoop by HeadlessReplay
+struct ReplayFrame
+{
+	uint64_t time;				// when the batch was handled while recording, in nanoseconds after EventRecordStart
+	uint32_t eventCount;
+	uint64_t layoutTime;		// nanoseconds spent on each step handling the batch, summed over the windows
+	uint64_t paintTime;
+	uint64_t presentTime;
+	uint64_t pixelsPainted;
+};
+
+// Feed a recording from EventRecordStart through MessageLoop one batch at a time, as fast as possible
+// rather than with the recorded delays. The windows must already exist, in the same order as when it was
+// recorded, with the same contents for the timings to mean anything. Stops at the first recorded close.
+// Returns the frames, to be freed by the caller, or NULL if the file isn't a recording.
+ReplayFrame *HeadlessReplay(const char *path, size_t *frameCount);
+#endif
 
 ////////////////////////////////////
 //- Core UI Logic
 
 Element *ElementCreate(size_t bytes, Element *parent, uint32_t flags, MessageHandler messageClass);
+void ElementDestroy(Element *element);		// Destroy the element and its descendants, removing it from its parent
+
+// Changing the tree. Elements can only move between parents in the same window.
+// The affected area is repainted and the parent is marked for relayout.
+void ElementInsert(Element *element, Element *parent, uint32_t index);	// Attach a detached element as parent->children[index], shifting later children along
+void ElementRemove(Element *element);									// Detach the element from its parent without destroying it
+void ElementReorder(Element *element, uint32_t index);					// Move the element to index among its siblings (painted later = on top)
+
+ElementHandle ElementGetHandle(Element *element);
+Element *ElementFromHandle(Window *window, ElementHandle handle);	// NULL if no element has the handle
+Element *ElementFindByPoint(Window *window, int x, int y);	// The topmost element whose clip contains the pixel; NULL if it is outside the window
 void ElementRepaint(Element *element, Rectangle *region);
-void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout);
+void ElementMove(Element *element, Rectangle bounds, bool alwaysLayout);	// Takes effect immediately; if anything changed, the element is laid out in the next layout pass
+// Scroll the element's contents: its children move dx pixels left and dy pixels up, without being laid out.
+// The pixels already painted inside the element's clip are moved along with them, so only the strip that
+// scrolls into view is repainted. The element's own MSG_PAINT must look the same wherever it's scrolled to
+// (e.g. a plain background), since its pixels are moved too.
+void ElementScroll(Element *element, int dx, int dy);
+void ElementRelayout(Element *element);	// Ask for MSG_LAYOUT in the next layout pass. Requests are merged, so each element is laid out at most once per pass.
 int ElementMessage(Element *element, Message message, int di, void *dp);
 
+// Preferred sizes, from MSG_GET_WIDTH and MSG_GET_HEIGHT. The answer is kept on the element and given again
+// without sending the message, until the element is asked with a different constraint or ElementRemeasure is called.
+int ElementGetWidth(Element *element, int height);	// height = what the element will be given, or 0 if not known yet
+int ElementGetHeight(Element *element, int width);	// width = what the element will be given, or 0 if not known yet
+// The element's size or arrangement may have changed (e.g. its text, or a box's padding): forget its preferred size
+// and the sizes of the containers that were measured from it, and lay out the element and their parents again.
+// Adding, removing and reordering children forgets the parent's size (and lays it out, except when creating).
+void ElementRemeasure(Element *element);
+
+// Timers send MSG_TIMER to their element after intervalMs milliseconds, and then every intervalMs
+// milliseconds if repeat is set. They run on the message loop's thread; destroying the element removes them.
+uint32_t TimerCreate(Element *element, int intervalMs, bool repeat);	// Returns an id, never 0
+void TimerDestroy(uint32_t id);
+// Queue a message for the element, delivered by the message loop on its own thread. Unlike everything else
+// here, this can be called from any thread; it wakes the loop up if it's waiting. The element must still
+// exist when the message is delivered.
+void MessageLoopPost(Element *element, Message message, int di, void *dp);
+// Update (lay out and paint) at most framesPerSecond times a second. Repaints asked for in between
+// are merged into the next frame. 0, the default, removes the limit.
+void MessageLoopSetFrameRate(int framesPerSecond);
+
+// Write the recorded trace as Chrome trace event JSON, for chrome://tracing or Perfetto.
+// Call it between updates, not while other threads might be painting.
+// Returns false on I/O error, or if the library was built without ENABLE_TRACING.
+bool TraceExport(const char *path);
+void TraceClear();
+
+// Write the platform events MessageLoop handles (resizes, exposes and closing) to path as they happen,
+// with their timing and how they were batched, so HeadlessReplay can feed them through again later.
+// Recording stops by itself when MessageLoop returns because a window was closed.
+// Returns false if the file couldn't be created.
+bool EventRecordStart(const char *path);
+void EventRecordStop();
+
+#define PAINT_TILE_SIZE (64)	// 64x64 pixels is 16KB of bits, so a tile stays in L1 while its elements paint over each other
+
+struct PaintTile
+{
+	Rectangle clip;
+	uint64_t pixelsPainted, paintsCulled, elementsVisited;	// copied from the tile's painter, summed up after the threads finish
+	uint32_t depthMax;
+};
+
+// Opt in to painting the update region as PAINT_TILE_SIZE tiles spread over threadCount threads
+// (including the calling thread). Only used when every element being painted has ELEMENT_PAINT_THREAD_SAFE.
+// A threadCount of 1 or less goes back to painting on the calling thread only.
+void PaintSetThreadCount(int threadCount);
+
+// Opt in to painting the windows that need it at the same time, on threadCount threads (including the
+// calling thread). Like tiles, only windows where every element being painted has ELEMENT_PAINT_THREAD_SAFE
+// are painted this way, and those aren't also split into tiles unless they're the only one.
+// Layout stays on the calling thread. Each window is presented as soon as it's painted, one at a time.
+// A threadCount of 1 or less turns it off.
+void UpdateSetThreadCount(int threadCount);
+void PaintSetLayerBudget(size_t bytes);	// Memory allowed for all ELEMENT_LAYER bitmaps together
+
 ////////////////////////////////////
 //- Helpers
 
 Rectangle RectangleMake(int l, int r, int t, int b);
 Rectangle RectangleIntersection(Rectangle a, Rectangle b); 	// Compute the intersection of the rectangles, i.e. the biggest rectangle that fits into both. If the rectangles don't overlap, an invalid rectangle is returned (as per RectangleValid).
 Rectangle RectangleBounding(Rectangle a, Rectangle b); 		// Compute the smallest rectangle containing both of the input rectangles.
+Rectangle RectangleTranslate(Rectangle a, int dx, int dy);	// Move the rectangle by dx to the right and dy down.
 bool RectangleValid(Rectangle a);							// valid if width and height are positive
 bool RectangleEquals(Rectangle a, Rectangle b); 			// Returns true if all sides are equal.
 bool RectangleContains(Rectangle a, int x, int y); 			// Returns true if the pixel with its top-left at the given coordinate is contained inside the rectangle.
 
+void RegionAdd(Region *region, Rectangle r);				// Add the rectangle to the region, merging it with existing rectangles where that wastes little area. Empty rectangles are ignored.
+void RegionClip(Region *region, Rectangle clip);			// Intersect every rectangle in the region with clip, dropping those that become empty.
+int64_t RegionArea(Region *region);							// Number of pixels covered by the region.
+
+void *ArenaAllocate(Arena *arena, size_t bytes);	// Zeroed, aligned to ARENA_SIZE_CLASS_BYTES
+void ArenaFree(Arena *arena, void *pointer);
+void ArenaRelease(Arena *arena);					// Free every chunk at once; pointers from the arena become invalid
+
 void StringCopy(char **destination, size_t *destinationBytes, const char *source, ptrdiff_t sourceBytes);
 
 void DrawBlock(Painter *painter, Rectangle r, uint32_t fill);
+bool DrawFillKernelSupported(FillKernel kernel);	// Does this CPU (and OS) support the instructions used by the kernel?
+bool DrawSetFillKernel(FillKernel kernel);			// Force the Draw functions to use a specific kernel, e.g. for benchmarking. Returns false if unsupported.
+
+// The blending functions take premultiplied ARGB colours: 0xAARRGGBB where A is the opacity (255 = opaque) and R, G
+// and B have already been multiplied by A / 255 (see ColourPremultiply). The colour is composited over the pixels
+// already there, which are treated as premultiplied too. Fully opaque colours are drawn as fast as DrawBlock.
+uint32_t ColourPremultiply(uint32_t colour);		// Convert a straight (non-premultiplied) ARGB colour
+void DrawBlockBlend(Painter *painter, Rectangle r, uint32_t colour);
+void DrawGradient(Painter *painter, Rectangle r, uint32_t from, uint32_t to, bool vertical);	// Blend from the left (or top) edge's colour to the right (or bottom) edge's
+void DrawBorder(Painter *painter, Rectangle r, uint32_t colour, Rectangle borderSize);		// Blend the colour over the edges of the rectangle, each borderSize.l/r/t/b pixels thick
+void DrawRectangle(Painter *painter, Rectangle r, uint32_t fill, uint32_t border, Rectangle borderSize);	// DrawBorder, and blend fill over the inside
+
+// Draw the string (UTF-8; bytes = -1 if zero terminated) on one line in the bounds, vertically centred,
+// with each character a size x size pixel cell. align is TEXT_ALIGN_LEFT, TEXT_ALIGN_CENTER or TEXT_ALIGN_RIGHT.
+// Text that doesn't fit is clipped to the bounds.
+void DrawString(Painter *painter, Rectangle bounds, const char *string, ptrdiff_t bytes, uint32_t colour, int size, int align);
+int MeasureString(const char *string, ptrdiff_t bytes, int size);	// Width of the string in pixels, as DrawString would draw it
+
+// Set padding, gap and columns straight after creating the box, or call ElementRemeasure after changing them.
+// The box doesn't paint anything itself; give it a messageUser for that.
+Box *BoxCreate(Element *parent, uint32_t flags);
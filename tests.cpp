@@ -0,0 +1,125 @@
+// tests.cpp
+// Checks of library behaviour that's easy to get wrong without noticing on screen, run on the headless backend.
+// Prints each failed check and exits with 1 if there were any.
+// Build (Linux): ./build.sh, or g++ -g -pthread -DOS_HEADLESS=1 tests.cpp -o tests
+#define BUILD_EXAMPLE 0
+#include "main.cpp"
+
+int failures;
+
+#define CHECK(condition) do { if (!(condition)) { printf("%s:%d: %s failed\n", __func__, __LINE__, #condition); failures++; } } while (0)
+
+int FillMessage(Element *element, Message message, int di, void *dp)
+{
+	(void) di;
+
+	if (message == MSG_PAINT)
+	{
+		DrawBlock((Painter *) dp, element->bounds, 0x336699);
+	}
+
+	return 0;
+}
+
+// The pixels ElementScroll moves aren't repainted, but they must still be presented
+void TestScrollPresents()
+{
+	Window *window = WindowCreate("tests", 400, 400);
+	MessageLoop();
+	Element *element = ElementCreate(sizeof(Element), &window->e, 0, FillMessage);
+	ElementMove(element, RectangleMake(0, 200, 0, 200), false);
+	ElementRepaint(&window->e, NULL);
+	_Update();
+
+	uint64_t presented = window->pixelsPresented, scrolled = window->pixelsScrolled;
+	ElementScroll(element, 0, 10);
+	_Update();
+	CHECK(window->pixelsScrolled - scrolled == 200 * 190);
+	CHECK(window->pixelsPresented - presented == 200 * 200);
+
+	// Nothing else changed, so the next update has nothing to present
+	presented = window->pixelsPresented;
+	_Update();
+	CHECK(window->pixelsPresented == presented);
+
+	WindowDestroy(window);
+}
+
+// Changing a box's arrangement and calling ElementRemeasure must move its children, whether or not
+// anything has measured the box, and even if the box itself doesn't move
+void TestBoxRemeasure()
+{
+	Window *window = WindowCreate("tests", 200, 200);
+	MessageLoop();
+	Box *outer = BoxCreate(&window->e, BOX_COLUMN);
+	Box *inner = BoxCreate(&outer->e, BOX_ROW | ELEMENT_V_FILL);
+	Element *child = ElementCreate(sizeof(Element), &inner->e, ELEMENT_H_FILL, FillMessage);
+	ElementRelayout(&window->e);
+	_Update();
+	CHECK(RectangleEquals(inner->e.bounds, RectangleMake(0, 200, 0, 200)));
+	CHECK(RectangleEquals(child->bounds, RectangleMake(0, 200, 0, 200)));
+
+	// Nobody measures the outer box; the window just gives it all of its bounds
+	outer->padding = RectangleMake(10, 10, 10, 10);
+	ElementRemeasure(&outer->e);
+	_Update();
+	CHECK(RectangleEquals(inner->e.bounds, RectangleMake(10, 190, 10, 190)));
+	CHECK(RectangleEquals(child->bounds, RectangleMake(10, 190, 10, 190)));
+
+	// The inner box stays where it is, only its child moves
+	inner->padding = RectangleMake(5, 5, 5, 5);
+	ElementRemeasure(&inner->e);
+	_Update();
+	CHECK(RectangleEquals(inner->e.bounds, RectangleMake(10, 190, 10, 190)));
+	CHECK(RectangleEquals(child->bounds, RectangleMake(15, 185, 15, 185)));
+
+	// A column whose gap changes moves its later children, and, since it was measured, grows in its parent
+	Box *column = BoxCreate(&outer->e, BOX_COLUMN);
+	ElementCreate(sizeof(Element), &column->e, 0, FillMessage);
+	Element *second = ElementCreate(sizeof(Element), &column->e, 0, FillMessage);
+	ElementRelayout(&outer->e);
+	_Update();
+	CHECK(second->bounds.t == column->e.bounds.t);
+	column->gap = 7;
+	ElementRemeasure(&column->e);
+	_Update();
+	CHECK(second->bounds.t == column->e.bounds.t + 7);
+	CHECK(column->e.bounds.b - column->e.bounds.t == 7);
+
+	WindowDestroy(window);
+}
+
+// A translucent border thicker than half the rectangle still blends each pixel once
+void TestBorderOverlap()
+{
+	uint32_t bits[10 * 10], once = 0x204060;
+	for (int i = 0; i < 10 * 10; i++) bits[i] = 0x204060;
+
+	Painter painter = {};
+	painter.clip = RectangleMake(0, 10, 0, 10);
+	painter.bits = bits;
+	painter.width = painter.height = painter.stride = 10;
+	DrawBorder(&painter, RectangleMake(0, 10, 0, 10), 0x80FFFFFF, RectangleMake(6, 7, 8, 6));
+
+	painter.clip = RectangleMake(0, 1, 0, 1);
+	painter.bits = &once;
+	painter.width = painter.height = painter.stride = 1;
+	DrawBlockBlend(&painter, RectangleMake(0, 1, 0, 1), 0x80FFFFFF);
+
+	int wrong = 0;
+	for (int i = 0; i < 10 * 10; i++) if (bits[i] != once) wrong++;
+	CHECK(once != 0x204060);
+	CHECK(wrong == 0);
+}
+
+int main()
+{
+	Initialise();
+	TestScrollPresents();
+	TestBoxRemeasure();
+	TestBorderOverlap();
+
+	if (failures) printf("%d checks failed\n", failures);
+	else printf("all checks passed\n");
+	return failures ? 1 : 0;
+}